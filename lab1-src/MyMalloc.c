@@ -10,51 +10,426 @@
 // support multi-threaded programs.
 //
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 #include <pthread.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <signal.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 #include "MyMalloc.h"
+#include "MyMallocTrace.h"
+#include "MyMallocSizeClasses.h"
 
 #define ALLOCATED 1
 #define NOT_ALLOCATED 0
 #define ARENA_SIZE 2097152
 
-pthread_mutex_t mutex;
+#ifdef MYMALLOC_COMPACT_TAGS
+// A free block needs room for its list links and its footer
+#define MIN_OBJECT_SIZE (sizeof(FreeObject) + sizeof(size_t))
+#else
+#define MIN_OBJECT_SIZE sizeof(FreeObject)
+#endif
+
+//STATE of the allocator, declared in MyMalloc.h
+size_t _heapSize;
+void *_memStart;
+int _initialized;
+int _mallocCalls;
+int _freeCalls;
+int _reallocCalls;
+int _callocCalls;
+FreeObject *_freeList;
+FreeObject _freeListSentinel;
+
+// The heap behind the C interface. Its free list is the _freeList
+// declared in MyMalloc.h.
+static Heap _defaultHeap = { PTHREAD_MUTEX_INITIALIZER, &_freeListSentinel };
 
 static bool verbose = false;
 
+// Print the heap statistics at exit as well (MYMALLOC_STATS)
+static bool _printStats = false;
+
+// Keep freed small blocks in quick lists and coalesce them in batches
+// (MYMALLOC_DEFER_COALESCING)
+static bool _deferCoalescing = false;
+
+// Keep the free lists sorted by address, so first fit takes the lowest
+// fitting block, and carve objects from the start of free blocks
+// (MYMALLOC_ADDRESS_ORDERED)
+static bool _addressOrdered = false;
+
+// Milliseconds a released chunk stays in the chunk cache
+// (MYMALLOC_CHUNK_DECAY), 0 to unmap released chunks right away
+static unsigned long _chunkDecay = 10000;
+
+// Completely free chunks a heap keeps before it releases the next one
+// (MYMALLOC_RETAIN_CHUNKS)
+static size_t _retainChunks = 1;
+
+// Blocks looked at on each side in memory for a free neighbour before an
+// address-ordered insert walks the free list
+#define ORDERED_SEARCH_BLOCKS 16
+
+// Quick list bytes of a heap above which the lists are coalesced. A limit
+// below the size of a typical free/reallocate wave makes every wave spill
+// split fragments into the free list, so it is a whole arena.
+#define QUICK_LIST_LIMIT ARENA_SIZE
+
+// Slab region and slab metadata (MYMALLOC_SLABS). _slabRegionSize stays 0
+// while slabs are off, so no pointer is taken for a slab object.
+static char *_slabBase;
+static size_t _slabRegionSize;
+static Slab *_slabs;
+
+// Per-thread magazines in front of the slabs (MYMALLOC_MAGAZINES)
+static bool _magazines = false;
+
+// Thread-owned pages with mimalloc-style free lists instead of bitmap
+// slabs (MYMALLOC_PAGE_FREE_LISTS)
+static bool _pageFreeLists = false;
+
+// Keep the small objects of different threads on different cache lines
+// (MYMALLOC_CACHE_LINES): they come from thread-owned pages, and requests
+// of more than half a line take whole lines of their own
+static bool _cacheLines = false;
+
+// The CPU has AVX2, so findFreeSlot() can test half a slab map at once
+static bool _avx2 = false;
+
+static inline bool isSlabObject(void *ptr) {
+    return (size_t) ((char *) ptr - _slabBase) < _slabRegionSize;
+}
+
+static inline Slab *slabOf(void *ptr) {
+    return &_slabs[((char *) ptr - _slabBase) / SLAB_SPAN];
+}
+
+// Blocks of the emergency pool; untouched pages cost nothing
+static char _emergencyPool[EMERGENCY_POOL_SIZE] __attribute__((aligned(64)));
+
+static inline bool isEmergencyObject(void *ptr) {
+    return (size_t) ((char *) ptr - _emergencyPool) < EMERGENCY_POOL_SIZE;
+}
+
+// Set while the thread runs a public entry point that can take a lock.
+// A signal handler on the same thread reads it, hence sig_atomic_t.
+static __thread volatile sig_atomic_t _inMalloc __attribute__((tls_model("initial-exec")));
+
+/**
+ * @brief Marks the thread as inside the allocator until leaveAllocator().
+ * The fences keep the compiler from moving the heap work across the
+ * stores, so a handler that finds the flag clear knows the thread holds
+ * none of the allocator's locks.
+ * @return the previous value, set if the call comes from a handler
+ */
+static inline sig_atomic_t enterAllocator() {
+    sig_atomic_t outer = _inMalloc;
+    _inMalloc = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    return outer;
+}
+
+static inline void leaveAllocator(sig_atomic_t outer) {
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    _inMalloc = outer;
+}
+
+// Milliseconds between two passes of the maintenance thread
+// (MYMALLOC_BACKGROUND), 0 when there is no thread, and the CPU it is
+// pinned to (MYMALLOC_BACKGROUND_CPU), -1 for any
+static unsigned long _maintenanceInterval = 0;
+static int _maintenanceCpu = -1;
+
+// Heap profiler output file (MYMALLOC_PROF), NULL when profiling is off
+static const char *_profPath;
+
+// Mean number of bytes between two samples (MYMALLOC_PROF_SAMPLE)
+static size_t _profSampleRate = 524288;
+
+// Allocation trace file (MYMALLOC_TRACE), -1 when tracing is off
+static int _traceFd = -1;
+static _Atomic off_t _traceOffset;
+
 extern void atExitHandlerInC() {
-    if (verbose)
+    malloc_trace_flush();
+    if (_profPath != NULL)
+        heap_profile_dump(_profPath);
+    else if (verbose)
         print();
+    if (_printStats)
+        print_stats();
 }
 
+// Serializes sbrk(), which threads growing the default heap call without
+// holding its mutex
+static pthread_mutex_t _sbrkMutex = PTHREAD_MUTEX_INITIALIZER;
+
 static void *getMemoryFromOS(size_t size) {
-    // Use sbrk() to get memory from OS
-    _heapSize += size;
+    // Use sbrk() to get memory from OS. The break is moved to a page
+    // boundary first, since released chunks are unmapped like mapped ones.
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    pthread_mutex_lock(&_sbrkMutex);
+    size_t misalignment = (uintptr_t) sbrk(0) & (pageSize - 1);
+    void *mem = (void *) -1;
+    if (misalignment == 0 || sbrk(pageSize - misalignment) != (void *) -1)
+        mem = sbrk(size);
+    pthread_mutex_unlock(&_sbrkMutex);
+    if (mem == (void *) -1)
+        return NULL;
+    return mem;
+}
+
+/**
+ * @brief Maps a chunk for a named heap. addChunk() links it into the
+ * heap's chunk list so heap_destroy() can unmap it.
+ */
+static HeapChunk *mapHeapChunk(size_t size) {
+    HeapChunk *chunk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED)
+        return NULL;
+    chunk->_size = size;
+    return chunk;
+}
 
-    void *mem = sbrk(size);
 
-    if (!_initialized) {
-        _memStart = mem;
+#ifdef MYMALLOC_COMPACT_TAGS
+// Bit 2 of a tag is set when the block on its left is free; the left
+// size is then the footer in the last word of that block
+#define getLeftSize(tag) (((size_t *) (tag))[-1])
+#define isLeftFree(tag)  (((tag)->_objectSizeAndAlloc) & 4)
+
+/**
+ * @brief Records the block left of tag: writes the footer and sets bit 2
+ * if the block is free, clears bit 2 otherwise
+ */
+static inline void setLeftTag(BoundaryTag *tag, size_t leftSize, bool leftFree) {
+    if (leftFree) {
+        ((size_t *) tag)[-1] = leftSize;
+        tag->_objectSizeAndAlloc |= 4;
+    } else {
+        tag->_objectSizeAndAlloc &= ~4UL;
+    }
+}
+#else
+#define getLeftSize(tag) ((tag)->_leftObjectSize)
+
+// a left size of 0 means the head fence post is on the left
+#define isLeftFree(tag) \
+  ((tag)->_leftObjectSize != 0 && !isAllocated((BoundaryTag *) ((char *) (tag) - (tag)->_leftObjectSize)))
+
+static inline void setLeftTag(BoundaryTag *tag, size_t leftSize, bool leftFree) {
+    tag->_leftObjectSize = leftSize;
+}
+#endif
+
+//
+// Block splitting and coalescing
+//
+// The private heaps and the shared heaps lay out blocks the same way; they
+// only differ in the tag format and in how free blocks are linked. Both get
+// their split and merge functions from this definition, with the list and
+// left tag operations passed in.
+//
+
+#define DEFINE_BLOCK_FUNCTIONS(prefix, HeapType, FreeType, TagType, minSize, insertOp, removeOp, replaceOp,     \
+                               isLeftFreeOp, getLeftSizeOp, setLeftTagOp)                                     \
+/* Takes *size bytes from the end of the free block ptr, or from its start                                    \
+ * if low is set, or the whole block if the rest could not be a free block.                                   \
+ * The rest keeps ptr's place in the free list. Sets *size to the size                                        \
+ * taken */                                                                                                   \
+static FreeType *prefix##SplitBlock(HeapType *heap, FreeType *ptr, size_t *size, bool low) {                  \
+    size_t blockSize = getSize(&ptr->boundary_tag);                                                           \
+    size_t roundedSize = *size;                                                                               \
+    FreeType *f = ptr;                                                                                        \
+    if (blockSize - roundedSize >= (minSize) && low) {                                                        \
+        /* the left neighbour of a free block is never free */                                                \
+        FreeType *rest = (FreeType *) ((char *) ptr + roundedSize);                                           \
+        rest->boundary_tag._objectSizeAndAlloc = blockSize - roundedSize;                                     \
+        setLeftTagOp((TagType *) ((char *) ptr + blockSize), blockSize - roundedSize, true);                  \
+        replaceOp(heap, ptr, rest);                                                                           \
+        f->boundary_tag._objectSizeAndAlloc = roundedSize | ALLOCATED;                                        \
+    } else if (blockSize - roundedSize >= (minSize)) {                                                        \
+        setSize(&ptr->boundary_tag, blockSize - roundedSize);                                                 \
+        f = (FreeType *) ((char *) ptr + blockSize - roundedSize);                                            \
+        f->boundary_tag._objectSizeAndAlloc = roundedSize | ALLOCATED;                                        \
+        setLeftTagOp(&f->boundary_tag, blockSize - roundedSize, true);                                        \
+    } else {                                                                                                  \
+        removeOp(heap, ptr);                                                                                  \
+        roundedSize = blockSize;                                                                              \
+        setAllocated(&f->boundary_tag, ALLOCATED);                                                            \
+    }                                                                                                         \
+    setLeftTagOp((TagType *) ((char *) f + roundedSize), roundedSize, false);                                 \
+    *size = roundedSize;                                                                                      \
+    return f;                                                                                                 \
+}                                                                                                             \
+                                                                                                              \
+/* Marks the block initptr free and merges it with its free neighbours.                                       \
+ * Returns the free block that holds it */                                                                    \
+static FreeType *prefix##MergeBlock(HeapType *heap, FreeType *initptr) {                                      \
+    size_t currSize = getSize(&initptr->boundary_tag);                                                        \
+    bool leftFree = isLeftFreeOp(&initptr->boundary_tag);                                                     \
+    size_t leftSize = leftFree ? getLeftSizeOp(&initptr->boundary_tag) : 0;                                   \
+    FreeType *left = (FreeType *) ((char *) initptr - leftSize);                                              \
+    FreeType *right = (FreeType *) ((char *) initptr + currSize);                                             \
+    bool rightFree = !isAllocated(&right->boundary_tag);                                                      \
+                                                                                                              \
+    FreeType *merged = initptr;                                                                               \
+    if (leftFree && rightFree) {                                                                              \
+        /* left absorbs both; right leaves the list */                                                        \
+        removeOp(heap, right);                                                                                \
+        setSize(&left->boundary_tag, leftSize + currSize + getSize(&right->boundary_tag));                    \
+        merged = left;                                                                                        \
+    } else if (leftFree) {                                                                                    \
+        /* left absorbs the block and keeps its place in the list */                                          \
+        setSize(&left->boundary_tag, leftSize + currSize);                                                    \
+        merged = left;                                                                                        \
+    } else if (rightFree) {                                                                                   \
+        /* the block absorbs right and takes its place in the list */                                         \
+        initptr->boundary_tag._objectSizeAndAlloc = currSize + getSize(&right->boundary_tag);                 \
+        replaceOp(heap, right, initptr);                                                                      \
+    } else {                                                                                                  \
+        initptr->boundary_tag._objectSizeAndAlloc = currSize;                                                 \
+        insertOp(heap, initptr);                                                                              \
+    }                                                                                                         \
+    setLeftTagOp((TagType *) ((char *) merged + getSize(&merged->boundary_tag)), getSize(&merged->boundary_tag), \
+                 true);                                                                                       \
+    return merged;                                                                                            \
+}
+
+//
+// Chunk cache
+//
+
+static CachedChunk _chunkCache[CHUNK_CACHE_SLOTS];
+static size_t _cachedChunks;
+static size_t _chunkCacheHits;
+static size_t _chunkCacheMisses;
+static pthread_mutex_t _chunkCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Unmaps the cached chunks that were released more than
+ * _chunkDecay milliseconds ago. Called with _chunkCacheMutex held.
+ */
+static void expireCachedChunks() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    size_t kept = 0;
+    for (size_t i = 0; i < _cachedChunks; i++) {
+        CachedChunk *c = &_chunkCache[i];
+        long age = (now.tv_sec - c->_releasedAt.tv_sec) * 1000 +
+                   (now.tv_nsec - c->_releasedAt.tv_nsec) / 1000000;
+        if (age >= (long) _chunkDecay)
+            munmap(c->_mem, c->_size);
+        else
+            _chunkCache[kept++] = *c;
     }
+    _cachedChunks = kept;
+}
+
+/**
+ * @brief Keeps a chunk that a heap no longer uses mapped for reuse,
+ * unmapping the oldest cached chunk if the cache is full
+ * @param mapped whether the chunk came from mmap() rather than sbrk()
+ */
+static void releaseChunk(void *mem, size_t size, bool mapped) {
+    __atomic_sub_fetch(&_heapSize, size, __ATOMIC_RELAXED);
+    if (_chunkDecay == 0) {
+        munmap(mem, size);
+        return;
+    }
+
+    pthread_mutex_lock(&_chunkCacheMutex);
+    expireCachedChunks();
+    if (_cachedChunks == CHUNK_CACHE_SLOTS) {
+        munmap(_chunkCache[0]._mem, _chunkCache[0]._size);
+        memmove(_chunkCache, _chunkCache + 1, --_cachedChunks * sizeof(CachedChunk));
+    }
+    CachedChunk *c = &_chunkCache[_cachedChunks++];
+    c->_mem = mem;
+    c->_size = size;
+    c->_mapped = mapped;
+    clock_gettime(CLOCK_MONOTONIC, &c->_releasedAt);
+    pthread_mutex_unlock(&_chunkCacheMutex);
+}
 
+/**
+ * @brief Takes the most recently released cached chunk of size bytes that
+ * came from mmap() if mapped is set, or from sbrk() otherwise
+ * @return the chunk, or NULL if there is none
+ */
+static void *takeCachedChunk(size_t size, bool mapped) {
+    void *mem = NULL;
+    pthread_mutex_lock(&_chunkCacheMutex);
+    expireCachedChunks();
+    for (size_t i = _cachedChunks; i-- > 0;) {
+        if (_chunkCache[i]._size == size && _chunkCache[i]._mapped == mapped) {
+            mem = _chunkCache[i]._mem;
+            memmove(_chunkCache + i, _chunkCache + i + 1, (--_cachedChunks - i) * sizeof(CachedChunk));
+            break;
+        }
+    }
+    if (mem != NULL)
+        _chunkCacheHits++;
+    else
+        _chunkCacheMisses++;
+    pthread_mutex_unlock(&_chunkCacheMutex);
     return mem;
 }
 
+/**
+ * @brief Asks the OS for a chunk of size bytes for heap. The default heap
+ * grows with sbrk(); named heaps map their chunks so they can be unmapped
+ * at once. Does not touch the heap, so it may be called without its mutex.
+ */
+static void *requestChunk(Heap *heap, size_t size) {
+    void *mem = takeCachedChunk(size, heap != &_defaultHeap);
+    if (mem != NULL)
+        return mem;
+    if (heap == &_defaultHeap)
+        return getMemoryFromOS(size);
+    return mapHeapChunk(size);
+}
 
 /*
- * @brief retrieves a new 2MB chunk of memory from the OS
- * and adds "dummy" boundary tags
- * @param size of the request
- * @return a FreeObject pointer to the beginning of the chunk
+ * @brief adds a chunk returned by requestChunk() to the heap's accounting
+ * and adds "dummy" boundary tags. Called with the heap mutex held.
+ * @param size of the chunk
+ * @return a FreeObject pointer to the beginning of the chunk, set up as
+ * one free block that spans the whole chunk (not yet in the free list)
  */
-static FreeObject *getNewChunk(size_t size) {
-    void *mem = getMemoryFromOS(size);
+static FreeObject *addChunk(Heap *heap, void *mem, size_t size) {
+    __atomic_add_fetch(&_heapSize, size, __ATOMIC_RELAXED);
+    if (heap == &_defaultHeap) {
+        if (!_initialized)
+            _memStart = mem;
+    } else {
+        // a chunk from the chunk cache keeps no header of its own
+        HeapChunk *heapChunk = mem;
+        heapChunk->_size = size;
+        heapChunk->_next = heap->_chunks;
+        heap->_chunks = heapChunk;
+        mem = heapChunk + 1;
+        size -= sizeof(HeapChunk);
+    }
+    heap->_heapSize += size;
 
     // establish fence posts
     BoundaryTag *fencePostHead = (BoundaryTag *) mem;
@@ -66,9 +441,118 @@ static FreeObject *getNewChunk(size_t size) {
     setAllocated(fencePostFoot, ALLOCATED);
     setSize(fencePostFoot, 0);
 
-    return (FreeObject *) ((char *) mem + sizeof(BoundaryTag));
+    // the block right of the head fence post has a left size of 0
+    FreeObject *chunk = (FreeObject *) ((char *) mem + sizeof(BoundaryTag));
+    chunk->boundary_tag._objectSizeAndAlloc = size - (2 * sizeof(BoundaryTag)); // ~2MB
+    setLeftTag(&chunk->boundary_tag, 0, false);
+    setLeftTag(fencePostFoot, getSize(&chunk->boundary_tag), true);
+    heap->_freeBytes += getSize(&chunk->boundary_tag);
+
+    return chunk;
+}
+
+/**
+ * @brief retrieves a new chunk of memory from the OS while holding the
+ * heap mutex. Only used to set up the first chunk of the default heap.
+ * @return the chunk as one free block (not yet in the free list), or NULL
+ * if the OS is out of memory
+ */
+static FreeObject *getNewChunk(Heap *heap, size_t size) {
+    void *mem = requestChunk(heap, size);
+    if (mem == NULL)
+        return NULL;
+    return addChunk(heap, mem, size);
+}
+
+/**
+ * @brief Grows the heap by a 2MB chunk. The heap mutex is dropped while
+ * the OS call runs, so other threads keep allocating from the memory the
+ * heap already has; the chunk is set up and returned under the mutex
+ * again. Callers must not rely on the free list being unchanged.
+ * @return the chunk as one free block (not yet in the free list), or NULL
+ * if the OS is out of memory
+ */
+static FreeObject *growHeap(Heap *heap) {
+    pthread_mutex_unlock(&heap->_mutex);
+    void *mem = requestChunk(heap, ARENA_SIZE);
+    pthread_mutex_lock(&heap->_mutex);
+    if (mem == NULL)
+        return NULL;
+    return addChunk(heap, mem, ARENA_SIZE);
+}
+
+/**
+ * @return the boundary tag of the block that follows o in memory
+ */
+static BoundaryTag *rightTag(FreeObject *o) {
+    return (BoundaryTag *) ((char *) o + getSize(&o->boundary_tag));
+}
+
+/**
+ * @brief Finds the free block that o follows in an address-ordered free
+ * list: the nearest free block below o. Coalescing leaves no free block
+ * right next to o, but one is usually a few blocks away in memory, which
+ * saves walking the list.
+ */
+static FreeObject *orderedPredecessor(Heap *heap, FreeObject *o) {
+    // the nearest free block above o comes right after it in the list
+    BoundaryTag *tag = rightTag(o);
+    for (int i = 0; i < ORDERED_SEARCH_BLOCKS && getSize(tag) != 0; i++) {
+        if (!isAllocated(tag))
+            return ((FreeObject *) tag)->free_list_node._prev;
+        tag = (BoundaryTag *) ((char *) tag + getSize(tag));
+    }
+#ifndef MYMALLOC_COMPACT_TAGS
+    // compact tags only record the size of a free left block
+    tag = &o->boundary_tag;
+    for (int i = 0; i < ORDERED_SEARCH_BLOCKS && tag->_leftObjectSize != 0; i++) {
+        tag = (BoundaryTag *) ((char *) tag - tag->_leftObjectSize);
+        if (!isAllocated(tag))
+            return (FreeObject *) tag;
+    }
+#endif
+    FreeObject *prev = heap->_freeList;
+    while (prev->free_list_node._next != heap->_freeList && prev->free_list_node._next < o)
+        prev = prev->free_list_node._next;
+    return prev;
+}
+
+/**
+ * @brief Adds a free block to the free list: at the head, or at its
+ * address in address-ordered mode
+ */
+static void insertFreeObject(Heap *heap, FreeObject *o) {
+    FreeObject *prev = _addressOrdered ? orderedPredecessor(heap, o) : heap->_freeList;
+    o->free_list_node._next = prev->free_list_node._next;
+    o->free_list_node._prev = prev;
+    prev->free_list_node._next->free_list_node._prev = o;
+    prev->free_list_node._next = o;
+}
+
+/**
+ * @brief Unlinks a free block from the free list
+ */
+static void removeFreeObject(FreeObject *o) {
+    o->free_list_node._prev->free_list_node._next = o->free_list_node._next;
+    o->free_list_node._next->free_list_node._prev = o->free_list_node._prev;
+}
+
+/**
+ * @brief Puts o into the free list position of the free block old
+ */
+static void replaceFreeObject(FreeObject *old, FreeObject *o) {
+    o->free_list_node._next = old->free_list_node._next;
+    o->free_list_node._prev = old->free_list_node._prev;
+    o->free_list_node._prev->free_list_node._next = o;
+    o->free_list_node._next->free_list_node._prev = o;
 }
 
+#define removeHeapObject(heap, o) removeFreeObject(o)
+#define replaceHeapObject(heap, old, o) replaceFreeObject(old, o)
+
+DEFINE_BLOCK_FUNCTIONS(heap, Heap, FreeObject, BoundaryTag, MIN_OBJECT_SIZE, insertFreeObject, removeHeapObject,
+                       replaceHeapObject, isLeftFree, getLeftSize, setLeftTag)
+
 /**
  * @brief If no blocks have been allocated, get more memory and 
  * set up the free list
@@ -76,277 +560,3553 @@ static FreeObject *getNewChunk(size_t size) {
 static void initialize() {
     verbose = true;
 
-    pthread_mutex_init(&mutex, NULL);
+    // heap profiler settings
+    _profPath = getenv("MYMALLOC_PROF");
+    const char *sampleRate = getenv("MYMALLOC_PROF_SAMPLE");
+    if (sampleRate != NULL && strtoul(sampleRate, NULL, 10) > 0)
+        _profSampleRate = strtoul(sampleRate, NULL, 10);
+
+    // allocation trace
+    const char *tracePath = getenv("MYMALLOC_TRACE");
+    if (tracePath != NULL) {
+        int fd = open(tracePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRecord) };
+        if (fd >= 0 && write(fd, &header, sizeof(header)) == sizeof(header)) {
+            _traceOffset = sizeof(header);
+            _traceFd = fd;
+        }
+    }
+
+    _printStats = getenv("MYMALLOC_STATS") != NULL;
+    _deferCoalescing = getenv("MYMALLOC_DEFER_COALESCING") != NULL;
+    _addressOrdered = getenv("MYMALLOC_ADDRESS_ORDERED") != NULL;
+    const char *decay = getenv("MYMALLOC_CHUNK_DECAY");
+    if (decay != NULL)
+        _chunkDecay = strtoul(decay, NULL, 10);
+    const char *retain = getenv("MYMALLOC_RETAIN_CHUNKS");
+    if (retain != NULL)
+        _retainChunks = strtoul(retain, NULL, 10);
+
+    // slab region and metadata; untouched pages cost nothing
+    _cacheLines = getenv("MYMALLOC_CACHE_LINES") != NULL;
+    if (getenv("MYMALLOC_SLABS") != NULL || _cacheLines) {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+        void *region = mmap(NULL, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+        void *slabs = mmap(NULL, SLAB_REGION_SIZE / SLAB_SPAN * sizeof(Slab), PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (region != MAP_FAILED && slabs != MAP_FAILED) {
+            _slabBase = region;
+            _slabs = slabs;
+            _slabRegionSize = SLAB_REGION_SIZE;
+#ifdef __x86_64__
+            __builtin_cpu_init();
+            _avx2 = __builtin_cpu_supports("avx2");
+#endif
+            _magazines = getenv("MYMALLOC_MAGAZINES") != NULL;
+            _pageFreeLists = getenv("MYMALLOC_PAGE_FREE_LISTS") != NULL || _cacheLines;
+        }
+    }
 
     // print statistics at exit
     atexit(atExitHandlerInC);
 
-    FreeObject *firstChunk = getNewChunk(ARENA_SIZE);
-
     // initialize the list to point to the firstChunk
     _freeList = &_freeListSentinel;
-    setSize(&firstChunk->boundary_tag, ARENA_SIZE - (2 * sizeof(BoundaryTag))); // ~2MB
-    firstChunk->boundary_tag._leftObjectSize = 0;
-    setAllocated(&firstChunk->boundary_tag, NOT_ALLOCATED);
-
-    // link list pointer hookups
-    firstChunk->free_list_node._next = _freeList;
-    firstChunk->free_list_node._prev = _freeList;
-    _freeList->free_list_node._prev = firstChunk;
-    _freeList->free_list_node._next = firstChunk;
+    _freeList->free_list_node._next = _freeList;
+    _freeList->free_list_node._prev = _freeList;
+    FreeObject *firstChunk = getNewChunk(&_defaultHeap, ARENA_SIZE);
+    if (firstChunk != NULL) {
+        insertFreeObject(&_defaultHeap, firstChunk);
+        _defaultHeap._emptyChunks++;
+    }
 
     _initialized = 1;
 }
 
 /**
- * @brief TODO: PART 1
- * This function should perform allocation to the program appropriately,
- * giving pieces of memory that large enough to satisfy the request. 
- * Currently, it just sbrk's memory every time.
- *
- * @param size size of the request
+ * @brief Hands out roundedSize bytes of the free block ptr. If the rest is
+ * large enough to hold a free block, the end of ptr is split off, or its
+ * start in address-ordered mode so that the heap fills from low addresses
+ * up, and the rest keeps ptr's place in the free list; otherwise the whole
+ * block is taken.
  *
- * @return pointer to the first usable byte in memory for the requesting
- * program
+ * @return pointer to the first usable byte of the allocated block
  */
-static void *allocateObject(size_t size) {
+static void *carveObject(Heap *heap, FreeObject *ptr, size_t roundedSize, size_t size) {
+    FreeObject *f = heapSplitBlock(heap, ptr, &roundedSize, _addressOrdered);
+    setPadding(&f->boundary_tag, roundedSize - sizeof(BoundaryTag) - size);
 
-    // Make sure that allocator is initialized
-    if (!_initialized)
-        initialize();
+    heap->_freeBytes -= roundedSize;
+    heap->_allocatedBytes += roundedSize;
+    heap->_requestedBytes += size;
+
+    return (void *) ((char *) f + sizeof(BoundaryTag));
+}
+
+/**
+ * @brief Maps a request size of 1 to SIZE_CLASS_MAX bytes to its size class
+ * in MyMallocSizeClasses.h with one table load
+ */
+static inline unsigned sizeClass(size_t size) {
+    return _sizeClassIndex[(size + 7) >> 3];
+}
+
+/**
+ * @brief Computes the block size that holds a request of size bytes
+ *
+ * @return the block size, or 0 (with errno set) if size cannot be allocated
+ */
+static size_t roundObjectSize(size_t size) {
     if (size == 0 || size >= ARENA_SIZE) {
         errno = ENOMEM;
-        return NULL;
+        return 0;
     }
     //Round up the requested size to the next 8 byte boundary.
     size_t roundedSize = (size + sizeof(BoundaryTag) + 7) & ~7;
     //The minimum size of an allocation is sizeof(FreeObject) as when the memory is freed it will take that much
     // space to maintain its place in the free list. If a smaller size of bytes is allocated then there will be
     // potential for corrupting the next block’s boundary tag
-    if (roundedSize < sizeof(struct FreeObject))
-        roundedSize = sizeof(struct FreeObject);
-    FreeObject *ptr = _freeList->free_list_node._next;
-    //Traverse the free list from the beginning, and find the first block large enough to satisfy the request
-    // (first fit).
-    while (ptr != _freeList) {
-        size_t reminder = ptr->boundary_tag._objectSizeAndAlloc - roundedSize;
-        //fprintf(stderr, "%zu\n", reminder);
-        //If the block is large enough to be split (that is, the remainder is at least the size of the headers),
-        // split the block in two.
-        if ((ptr->boundary_tag._objectSizeAndAlloc >= roundedSize) &&
-            (reminder >= (sizeof(FreeObject)))) {
-            char *_mem = (char *) ptr + ptr->boundary_tag._objectSizeAndAlloc - roundedSize;
-            setSize(&ptr->boundary_tag, ptr->boundary_tag._objectSizeAndAlloc - roundedSize);
-            FreeObject *f = (FreeObject *) _mem;
-            //Set the _allocated bit in the header
-            setSize(&f->boundary_tag, roundedSize);
-            setAllocated(&f->boundary_tag, ALLOCATED);
-
-    //fprintf(stderr, "left= %zu\n", isAllocated(&f->boundary_tag));
-            // and update the proceeding block’s _leftObjectSize to the size of the allocated block.
-            f->boundary_tag._leftObjectSize = ptr->boundary_tag._objectSizeAndAlloc;
-            //The chosen block should be removed from the free list and returned to satisfy the request
-            //TODO
-            FreeObject *right = (FreeObject *) ptr + roundedSize;
-            right->boundary_tag._leftObjectSize = roundedSize;
-
-            pthread_mutex_unlock(&mutex);
-            return (void *) ((char *) f + sizeof(BoundaryTag));
-        }
-        // If the block is not large enough to be split, simply remove that block from the list and return it.
-        else if (ptr->boundary_tag._objectSizeAndAlloc >= roundedSize && reminder < (sizeof(FreeObject))) {
-            ptr->free_list_node._prev->free_list_node._next = ptr->free_list_node._next;
-            ptr->free_list_node._next->free_list_node._prev = ptr->free_list_node._prev;
-            setAllocated(&ptr->boundary_tag, ALLOCATED);
-            pthread_mutex_unlock(&mutex);
-            return (void *) ((char *) ptr + sizeof(BoundaryTag));
-        }
-        ptr = ptr->free_list_node._next;
-        // If the list does not have enough memory, request a new 2MB block, insert the block into the free list,
-        // and repeat step 3.
-
-        if (ptr == _freeList) {
-            // get 2MB from os
-            FreeObject *newChunk = getNewChunk(ARENA_SIZE);
-            //set size and alloc
-            setSize(&newChunk->boundary_tag, ARENA_SIZE - (2 * sizeof(BoundaryTag))); // ~2MB
-            newChunk->boundary_tag._leftObjectSize = 0;
-            setAllocated(&newChunk->boundary_tag, NOT_ALLOCATED);
-            // insert the block into the free list
-            newChunk->free_list_node._next = _freeList->free_list_node._next;
-            newChunk->free_list_node._prev = _freeList;
-            _freeList->free_list_node._next->free_list_node._prev = newChunk;
-            _freeList->free_list_node._next = newChunk;
-            FreeObject *right = (FreeObject *) ((char *)newChunk + newChunk->boundary_tag._objectSizeAndAlloc);
-            right->boundary_tag._leftObjectSize = newChunk->boundary_tag._objectSizeAndAlloc;
-            //return  allocateObject(size);
-//            ptr = _freeList->free_list_node._next;
+    if (roundedSize < MIN_OBJECT_SIZE)
+        roundedSize = MIN_OBJECT_SIZE;
+    if (roundedSize > ARENA_SIZE - (2 * sizeof(BoundaryTag))) {
+        errno = ENOMEM;
+        return 0;
+    }
+    return roundedSize;
+}
 
-        }
+/**
+ * @return the size of a free block that spans a whole chunk of heap
+ */
+static inline size_t emptyChunkSize(Heap *heap) {
+    size_t size = ARENA_SIZE - 2 * sizeof(BoundaryTag);
+    return heap == &_defaultHeap ? size : size - sizeof(HeapChunk);
+}
 
+/**
+ * @brief Takes the free block o, which spans a whole chunk, out of heap
+ * and hands the chunk to the chunk cache
+ */
+static void releaseEmptyChunk(Heap *heap, FreeObject *o) {
+    size_t size = getSize(&o->boundary_tag);
+    removeFreeObject(o);
+    heap->_freeBytes -= size;
+    heap->_heapSize -= size + 2 * sizeof(BoundaryTag);
 
+    void *mem = (char *) o - sizeof(BoundaryTag);
+    if (heap == &_defaultHeap) {
+        releaseChunk(mem, ARENA_SIZE, false);
+        return;
     }
-    //pthread_mutex_unlock(&mutex);
-    return getMemoryFromOS(size);
+    HeapChunk *chunk = (HeapChunk *) mem - 1;
+    HeapChunk **link = &heap->_chunks;
+    while (*link != chunk)
+        link = &(*link)->_next;
+    *link = chunk->_next;
+    releaseChunk(chunk, chunk->_size, true);
 }
 
+/**
+ * @brief Marks the block initptr free and merges it with its free
+ * neighbours. Its bytes are already accounted as free. If that frees a
+ * whole chunk and the heap already keeps _retainChunks empty chunks, the
+ * chunk is released.
+ */
+static void coalesceObject(Heap *heap, FreeObject *initptr) {
+    FreeObject *merged = heapMergeBlock(heap, initptr);
+
+    if (getSize(&merged->boundary_tag) == emptyChunkSize(heap)) {
+        if (heap->_emptyChunks < _retainChunks)
+            heap->_emptyChunks++;
+        else
+            releaseEmptyChunk(heap, merged);
+    }
+}
 
 /**
- * @brief TODO: PART 2
- * This funtion takes a pointer to memory returned by the program, and
- * appropriately reinserts it back into the free list.
- * You will have to manage all coalescing as needed
- *
- * @param ptr
+ * @brief Coalesces every block in the quick lists of heap
  */
-static void freeObject(void *ptr) {
-    FreeObject *initptr = (FreeObject *) ((char *) ptr - sizeof(BoundaryTag));
-    fprintf(stderr, "init=%zu\n", isAllocated(&initptr->boundary_tag));
-    size_t leftSize = initptr->boundary_tag._leftObjectSize;
-    size_t currSize = getSize(&initptr->boundary_tag);
-    FreeObject *left = (FreeObject *) ((char *) initptr - leftSize - sizeof(BoundaryTag));
-    FreeObject *right = (FreeObject *) ((char *) initptr + currSize);
-    //FreeObject *rright = (FreeObject *) ((char *) right + right->boundary_tag._objectSizeAndAlloc);
-   // int left_alloc = 0;
-   // int right_alloc = 0;
-   // if (isAllocated(&left->boundary_tag) /*&& (getSize(&left->boundary_tag) != 0)*/) left_alloc = 1;
-   // if (isAllocated(&right->boundary_tag) /*&& (getSize(&right->boundary_tag) != 0)*/) right_alloc = 1;
-    fprintf(stderr, "left= %zu, right = %zu\n", isAllocated(&left->boundary_tag), 
-            isAllocated(&right->boundary_tag));
-    //Check the if the header of one or both of the neighboring blocks are free. If they are free then coalesce the block being freed into the unallocated blocks.
-    if (isAllocated(&left->boundary_tag) && isAllocated(&right->boundary_tag)) { //both allocated
-        setAllocated(&initptr->boundary_tag, NOT_ALLOCATED);
-        initptr->free_list_node._next = _freeList->free_list_node._next;
-        initptr->free_list_node._prev = _freeList;
-        _freeList->free_list_node._next = initptr;
-    } else if (isAllocated(&left->boundary_tag) && !isAllocated(&right->boundary_tag)) { //left is allocated, merge to right
-        setSize(&left->boundary_tag,currSize+getSize(&right->boundary_tag));
-        setAllocated(&initptr->boundary_tag,NOT_ALLOCATED);
-        initptr->free_list_node._next = right->free_list_node._next;
-        initptr->free_list_node._prev = right->free_list_node._prev;
-    } else if (!isAllocated(&left->boundary_tag) && isAllocated(&right->boundary_tag)) { //left is free, merge to left
-        setAllocated(&initptr->boundary_tag, NOT_ALLOCATED);
-        setSize(&left->boundary_tag, leftSize+currSize);
-    } else { // coa both sides
-        setAllocated(&initptr->boundary_tag, NOT_ALLOCATED);
-        setSize(&left->boundary_tag, leftSize + currSize + getSize(&right->boundary_tag));
-        if (left == right->free_list_node._next) {
-            _freeList->free_list_node._next = left;
-        } else {
-            left->free_list_node._next = right->free_list_node._next;
+static void flushQuickLists(Heap *heap) {
+    for (size_t i = 0; i < HEAP_QUICK_LISTS; i++) {
+        FreeObject *o = heap->_quickLists[i];
+        heap->_quickLists[i] = NULL;
+        while (o != NULL) {
+            FreeObject *next = o->free_list_node._next;
+            coalesceObject(heap, o);
+            o = next;
         }
     }
+    heap->_quickBytes = 0;
+}
 
+/**
+ * @brief Hands out the most recently freed block of exactly roundedSize
+ * bytes from the quick lists
+ */
+static void *takeQuickObject(Heap *heap, size_t roundedSize, size_t size) {
+    FreeObject *o = heap->_quickLists[roundedSize >> 3];
+    heap->_quickLists[roundedSize >> 3] = o->free_list_node._next;
+    heap->_quickBytes -= roundedSize;
+    heap->_quickHits++;
 
+    // still allocated; only the sampled bit and the padding change
+    o->boundary_tag._objectSizeAndAlloc &= ~2UL;
+    setPadding(&o->boundary_tag, roundedSize - sizeof(BoundaryTag) - size);
 
+    heap->_freeBytes -= roundedSize;
+    heap->_allocatedBytes += roundedSize;
+    heap->_requestedBytes += size;
 
-    // If neither the left nor right neighbors are free, simply mark the block as free and insert it at the head
-    // of the free list.
-    //pthread_mutex_unlock(&mutex);
-
+    return (void *) ((char *) o + sizeof(BoundaryTag));
+}
 
+/**
+ * @brief Finds the first free block of at least roundedSize bytes, asking
+ * the OS for a new 2MB chunk when there is none
+ *
+ * @return the block, or NULL with errno set if the OS is out of memory
+ */
+static FreeObject *findFreeObject(Heap *heap, size_t roundedSize) {
+    for (;;) {
+        //Traverse the free list from the beginning, and find the first block large enough to satisfy the request
+        // (first fit).
+        FreeObject *ptr = heap->_freeList->free_list_node._next;
+        while (ptr != heap->_freeList) {
+            if (getSize(&ptr->boundary_tag) >= roundedSize) {
+                if (getSize(&ptr->boundary_tag) == emptyChunkSize(heap))
+                    heap->_emptyChunks--;
+                return ptr;
+            }
+            ptr = ptr->free_list_node._next;
+        }
+        // Blocks waiting in the quick lists may coalesce into a large enough one
+        if (heap->_quickBytes > 0) {
+            flushQuickLists(heap);
+            continue;
+        }
+        // If the list does not have enough memory, request a new 2MB block, insert the block into the free list,
+        // and repeat. The maintenance thread may already have reserved one. Other threads may free or add
+        // blocks while growHeap() waits for the OS, so the search starts over either way.
+        FreeObject *newChunk = heap->_spareChunk;
+        heap->_spareChunk = NULL;
+        if (newChunk == NULL)
+            newChunk = growHeap(heap);
+        if (newChunk == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        insertFreeObject(heap, newChunk);
+        heap->_emptyChunks++;
+    }
 }
 
-void print() {
-    printf("\n-------------------\n");
+/**
+ * @brief Allocates size bytes from the free list (first fit), asking the
+ * OS for a new 2MB chunk when no free block is large enough.
+ * Called with the heap mutex held.
+ *
+ * @param size size of the request
+ *
+ * @return pointer to the first usable byte in memory for the requesting
+ * program
+ */
+static void *allocateObject(Heap *heap, size_t size) {
 
-    printf("HeapSize:\t%zd bytes\n", _heapSize);
-    printf("# mallocs:\t%d\n", _mallocCalls);
-    printf("# reallocs:\t%d\n", _reallocCalls);
-    printf("# callocs:\t%d\n", _callocCalls);
-    printf("# frees:\t%d\n", _freeCalls);
+    // Make sure that allocator is initialized
+    if (!_initialized)
+        initialize();
+    size_t roundedSize = roundObjectSize(size);
+    if (roundedSize == 0)
+        return NULL;
 
-    printf("\n-------------------\n");
+    if (roundedSize <= HEAP_QUICK_MAX && heap->_quickLists[roundedSize >> 3] != NULL)
+        return takeQuickObject(heap, roundedSize, size);
+
+    FreeObject *ptr = findFreeObject(heap, roundedSize);
+    if (ptr == NULL)
+        return NULL;
+    return carveObject(heap, ptr, roundedSize, size);
 }
 
-void print_list() {
-    printf("FreeList: ");
+/**
+ * @brief Allocates an object whose payload is aligned to alignment, a power
+ * of two. The object is carved from the end of a free block at the highest
+ * aligned position; the bytes in front of it stay in the free block and a
+ * large enough gap behind it becomes a free block of its own.
+ *
+ * @return the payload, or NULL with errno set
+ */
+static void *allocateAlignedObject(Heap *heap, size_t alignment, size_t size) {
+    if (alignment <= 8)
+        return allocateObject(heap, size);
+
     if (!_initialized)
         initialize();
-    FreeObject *ptr = _freeList->free_list_node._next;
-    while (ptr != _freeList) {
-        long offset = (long) ptr - (long) _memStart;
-        printf("[offset:%ld,size:%zd]", offset, getSize(&ptr->boundary_tag));
-        ptr = ptr->free_list_node._next;
-        if (ptr != NULL)
-            printf("->");
+    size_t roundedSize = roundObjectSize(size);
+    if (roundedSize == 0)
+        return NULL;
+    // room for the object at any alignment with a free block in front
+    size_t searchSize = roundedSize + alignment + MIN_OBJECT_SIZE;
+    if (alignment >= ARENA_SIZE || searchSize > ARENA_SIZE - (2 * sizeof(BoundaryTag))) {
+        errno = ENOMEM;
+        return NULL;
     }
-    printf("\n");
-}
 
-void increaseMallocCalls() { _mallocCalls++; }
+    FreeObject *ptr = findFreeObject(heap, searchSize);
+    if (ptr == NULL)
+        return NULL;
 
-void increaseReallocCalls() { _reallocCalls++; }
+    char *end = (char *) ptr + getSize(&ptr->boundary_tag);
+    uintptr_t payload = ((uintptr_t) end - roundedSize + sizeof(BoundaryTag)) & ~(alignment - 1);
+    FreeObject *f = (FreeObject *) (payload - sizeof(BoundaryTag));
+    size_t frontSize = (char *) f - (char *) ptr;
+    size_t tailSize = end - ((char *) f + roundedSize);
 
-void increaseCallocCalls() { _callocCalls++; }
+    // the tags are complete before the tail goes into the free list, which
+    // may walk over them in address-ordered mode
+    setSize(&ptr->boundary_tag, frontSize);
+    if (tailSize < MIN_OBJECT_SIZE)
+        roundedSize += tailSize;
+    f->boundary_tag._objectSizeAndAlloc = roundedSize | ALLOCATED;
+    setLeftTag(&f->boundary_tag, frontSize, true);
+    if (tailSize >= MIN_OBJECT_SIZE) {
+        FreeObject *tail = (FreeObject *) ((char *) f + roundedSize);
+        tail->boundary_tag._objectSizeAndAlloc = tailSize;
+        setLeftTag(&tail->boundary_tag, roundedSize, false);
+        setLeftTag(rightTag(tail), tailSize, true);
+        insertFreeObject(heap, tail);
+    } else {
+        setLeftTag((BoundaryTag *) end, roundedSize, false);
+    }
+    setPadding(&f->boundary_tag, roundedSize - sizeof(BoundaryTag) - size);
 
-void increaseFreeCalls() { _freeCalls++; }
+    heap->_freeBytes -= roundedSize;
+    heap->_allocatedBytes += roundedSize;
+    heap->_requestedBytes += size;
 
-//
-// C interface
-//
+    return (void *) payload;
+}
 
-extern void *malloc(size_t size) {
-    pthread_mutex_lock(&mutex);
-    increaseMallocCalls();
+/**
+ * @brief Carves up to n objects of roundedSize bytes off the end of the
+ * free block ptr in one pass. The objects are laid out exactly as n calls
+ * of carveObject() would, but the free block's tag and its right
+ * neighbour's left size are only written once.
+ *
+ * @return the number of objects stored in ptrs
+ */
+static size_t carveObjects(Heap *heap, FreeObject *ptr, size_t roundedSize, size_t size, size_t n,
+                           void **ptrs) {
+    size_t blockSize = getSize(&ptr->boundary_tag);
+    size_t padding = roundedSize - sizeof(BoundaryTag) - size;
 
-    return allocateObject(size);
-}
+    // objects that still leave a splittable free block behind
+    size_t count = (blockSize - MIN_OBJECT_SIZE) / roundedSize;
+    if (count > n)
+        count = n;
 
-extern void free(void *ptr) {
-    pthread_mutex_lock(&mutex);
-    increaseFreeCalls();
+    if (count > 0) {
+        BoundaryTag *right = rightTag(ptr);
+        for (size_t i = 0; i < count; i++) {
+            FreeObject *f = (FreeObject *) ((char *) right - (i + 1) * roundedSize);
+            f->boundary_tag._objectSizeAndAlloc = roundedSize | ALLOCATED;
+            setPadding(&f->boundary_tag, padding);
+            setLeftTag(&f->boundary_tag, roundedSize, false);
+            ptrs[i] = (char *) f + sizeof(BoundaryTag);
+        }
+        setLeftTag(right, roundedSize, false);
+        setSize(&ptr->boundary_tag, blockSize - count * roundedSize);
+        // the lowest object sits right of what is left of the free block
+        BoundaryTag *lowest = (BoundaryTag *) ((char *) right - count * roundedSize);
+        setLeftTag(lowest, getSize(&ptr->boundary_tag), true);
 
-    if (ptr == 0) {
-        // No object to free
-        pthread_mutex_unlock(&mutex);
-        return;
+        heap->_freeBytes -= count * roundedSize;
+        heap->_allocatedBytes += count * roundedSize;
+        heap->_requestedBytes += count * size;
     }
 
-    freeObject(ptr);
+    // the rest of the block is too small to split, hand it out whole
+    if (count < n && getSize(&ptr->boundary_tag) >= roundedSize)
+        ptrs[count++] = carveObject(heap, ptr, roundedSize, size);
+    return count;
 }
 
-extern void *realloc(void *ptr, size_t size) {
-    pthread_mutex_lock(&mutex);
-    increaseReallocCalls();
-
-    // Allocate new object
-    void *newptr = allocateObject(size);
+/**
+ * @brief Reinserts the object at ptr into the free list, coalescing it
+ * with free neighbours. Called with the heap mutex held.
+ *
+ * @param ptr
+ */
+static void freeObject(Heap *heap, void *ptr) {
+    FreeObject *initptr = (FreeObject *) ((char *) ptr - sizeof(BoundaryTag));
+    size_t currSize = getSize(&initptr->boundary_tag);
 
-    // Copy old object only if ptr != 0
-    if (ptr != 0) {
+    heap->_freeBytes += currSize;
+    heap->_allocatedBytes -= currSize;
+    heap->_requestedBytes -= currSize - sizeof(BoundaryTag) - getPadding(&initptr->boundary_tag);
 
-        // copy only the minimum number of bytes
-        FreeObject *o = (FreeObject *) ((char *) ptr - sizeof(BoundaryTag));
-        size_t sizeToCopy = getSize(&o->boundary_tag);
-        if (sizeToCopy > size) {
-            sizeToCopy = size;
-        }
+    if (_deferCoalescing && currSize <= HEAP_QUICK_MAX) {
+        // the block stays marked allocated, so no neighbour merges with it
+        initptr->free_list_node._next = heap->_quickLists[currSize >> 3];
+        heap->_quickLists[currSize >> 3] = initptr;
+        heap->_quickBytes += currSize;
+        if (heap->_quickBytes > QUICK_LIST_LIMIT)
+            flushQuickLists(heap);
+        return;
+    }
+    coalesceObject(heap, initptr);
+}
 
-        memcpy(newptr, ptr, sizeToCopy);
+/**
+ * @brief Resizes the object at ptr in place to hold size bytes. It grows
+ * into a free block on its right, leaving what it does not need of that
+ * block free, and shrinks by giving back a tail large enough to be a free
+ * block of its own. Growth is rare unless MYMALLOC_ADDRESS_ORDERED is
+ * set: carveObject otherwise hands out the high end of a free block, so
+ * the right neighbour of an object is usually allocated. Called with the
+ * heap mutex held.
+ *
+ * @return the usable size of the object afterwards, less than size if it
+ * could not grow
+ */
+static size_t resizeObject(Heap *heap, void *ptr, size_t size) {
+    FreeObject *o = (FreeObject *) ((char *) ptr - sizeof(BoundaryTag));
+    size_t currSize = getSize(&o->boundary_tag);
+    size_t requested = currSize - sizeof(BoundaryTag) - getPadding(&o->boundary_tag);
+    int savedErrno = errno;
+    size_t roundedSize = roundObjectSize(size);
+    errno = savedErrno;
+    if (roundedSize == 0)
+        return currSize - sizeof(BoundaryTag);
+
+    if (roundedSize > currSize) {
+        FreeObject *right = (FreeObject *) rightTag(o);
+        size_t rightSize = getSize(&right->boundary_tag);
+        if (isAllocated(&right->boundary_tag) || currSize + rightSize < roundedSize)
+            return currSize - sizeof(BoundaryTag);
+
+        size_t restSize = currSize + rightSize - roundedSize;
+        if (restSize >= MIN_OBJECT_SIZE) {
+            // the rest of right keeps its place in the list; its new tag
+            // may overwrite right's links, so they are read first
+            FreeListNode links = right->free_list_node;
+            FreeObject *rest = (FreeObject *) ((char *) o + roundedSize);
+            rest->boundary_tag._objectSizeAndAlloc = restSize;
+            setLeftTag(&rest->boundary_tag, roundedSize, false);
+            rest->free_list_node = links;
+            links._prev->free_list_node._next = rest;
+            links._next->free_list_node._prev = rest;
+            setLeftTag(rightTag(rest), restSize, true);
+        } else {
+            removeFreeObject(right);
+            roundedSize = currSize + rightSize;
+            setLeftTag((BoundaryTag *) ((char *) o + roundedSize), roundedSize, false);
+        }
+        heap->_freeBytes -= roundedSize - currSize;
+        heap->_allocatedBytes += roundedSize - currSize;
+    } else if (currSize - roundedSize >= MIN_OBJECT_SIZE) {
+        // the tail is freed as an allocated block that nobody asked for
+        FreeObject *tail = (FreeObject *) ((char *) o + roundedSize);
+        size_t tailSize = currSize - roundedSize;
+        tail->boundary_tag._objectSizeAndAlloc = tailSize | ALLOCATED;
+        setLeftTag(&tail->boundary_tag, roundedSize, false);
+        setLeftTag(rightTag(tail), tailSize, false);
+        heap->_freeBytes += tailSize;
+        heap->_allocatedBytes -= tailSize;
+        coalesceObject(heap, tail);
+    } else {
+        roundedSize = currSize;
+    }
+
+    // the allocated, sampled and left-free bits stay as they are
+    o->boundary_tag._objectSizeAndAlloc = roundedSize | (o->boundary_tag._objectSizeAndAlloc & 7);
+    setPadding(&o->boundary_tag, roundedSize - sizeof(BoundaryTag) - size);
+    heap->_requestedBytes += size - requested;
+    return roundedSize - sizeof(BoundaryTag);
+}
+
+//
+// Sampling heap profiler
+//
+// Every thread counts down a geometrically distributed number of bytes; the
+// allocation that crosses zero is sampled, so on average one allocation is
+// recorded every _profSampleRate bytes. A sample keeps the backtrace of the
+// allocation site and stays live until the object is freed. Unsampled
+// allocations only pay one thread-local subtraction and compare.
+//
+
+#define PROF_MAX_DEPTH 32
+#define PROF_MAX_SKIP 8         // frames of the allocator itself, at most
+#define PROF_BUCKETS 4096       // distinct allocation sites, power of 2
+#define PROF_SAMPLES 65536      // live sampled objects, power of 2
+
+typedef struct ProfBucket {
+    uint64_t _hash;
+    int _depth;                 // 0 if the slot is empty
+    void *_stack[PROF_MAX_DEPTH];
+    size_t _allocs;
+    size_t _allocBytes;
+    size_t _frees;
+    size_t _freeBytes;
+} ProfBucket;
+
+typedef struct ProfSample {
+    void *_ptr;                 // NULL if the slot is empty
+    ProfBucket *_bucket;
+    size_t _size;
+} ProfSample;
+
+static pthread_mutex_t _profMutex = PTHREAD_MUTEX_INITIALIZER;
+static ProfBucket *_profBuckets;
+static ProfSample *_profSamples;
+static size_t _profLiveSamples;
+
+// Used once PROF_BUCKETS distinct sites have been seen
+static ProfBucket _profOverflowBucket;
+
+static __thread ssize_t _bytesUntilSample __attribute__((tls_model("initial-exec")));
+static __thread uint64_t _profRandom __attribute__((tls_model("initial-exec")));
+static __thread bool _inProfiler __attribute__((tls_model("initial-exec")));
+
+// Bounds of the MYMALLOC_TEXT section, set by the linker
+extern char __start_mymalloc_text[] __attribute__((visibility("hidden")));
+extern char __stop_mymalloc_text[] __attribute__((visibility("hidden")));
+
+/**
+ * @brief Whether the return address pc lies in a function an allocation
+ * passes through on its way to sampleAllocation()
+ */
+static inline bool isAllocatorText(void *pc) {
+    return (char *) pc >= __start_mymalloc_text && (char *) pc < __stop_mymalloc_text;
+}
+
+/**
+ * @brief Cheap log2 approximation, good to about 0.01, so sampling does not
+ * need libm
+ */
+static double fastLog2(double x) {
+    union { double d; uint64_t u; } v = { x };
+    double exponent = (double) ((int) ((v.u >> 52) & 0x7ff) - 1024);
+    v.u = (v.u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    return exponent + (-0.34484843 * v.d + 2.02466578) * v.d - 0.67487759;
+}
+
+/**
+ * @brief Picks the number of bytes until the next sample from an exponential
+ * distribution with mean _profSampleRate
+ */
+static ssize_t nextSampleInterval() {
+    if (_profRandom == 0)
+        _profRandom = ((uintptr_t) &_profRandom * 0x9E3779B97F4A7C15ULL) | 1;
+    // xorshift64*
+    _profRandom ^= _profRandom >> 12;
+    _profRandom ^= _profRandom << 25;
+    _profRandom ^= _profRandom >> 27;
+    uint64_t q = ((_profRandom * 0x2545F4914F6CDD1DULL) >> 38) + 1; // 1..2^26
+    // -ln(u) for u = q / 2^26 in (0, 1]
+    double interval = (26 - fastLog2((double) q)) * 0.6931471805599453 * _profSampleRate;
+    return (ssize_t) interval + 1;
+}
+
+static uint64_t hashStack(void **stack, int depth) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < depth; i++)
+        h = (h ^ (uintptr_t) stack[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static size_t hashPointer(void *ptr) {
+    return (size_t) (((uintptr_t) ptr >> 3) * 0x9E3779B97F4A7C15ULL >> 40);
+}
+
+/**
+ * @brief Finds the bucket of an allocation site, creating it if needed.
+ * Called with _profMutex held.
+ */
+static ProfBucket *findBucket(void **stack, int depth) {
+    uint64_t h = hashStack(stack, depth);
+    for (size_t i = 0; i < PROF_BUCKETS; i++) {
+        ProfBucket *b = &_profBuckets[(h + i) & (PROF_BUCKETS - 1)];
+        if (b->_depth == 0) {
+            b->_hash = h;
+            b->_depth = depth;
+            memcpy(b->_stack, stack, depth * sizeof(void *));
+            return b;
+        }
+        if (b->_hash == h && b->_depth == depth &&
+            memcmp(b->_stack, stack, depth * sizeof(void *)) == 0)
+            return b;
+    }
+    return &_profOverflowBucket;
+}
+
+/**
+ * @brief Records a backtrace for an allocation whose countdown expired and
+ * starts the next countdown
+ */
+static __attribute__((noinline)) MYMALLOC_TEXT void sampleAllocation(void *ptr, size_t size) {
+    if (_profPath == NULL) {
+        // profiling is off; keep the fast path from firing again
+        _bytesUntilSample = SSIZE_MAX;
+        return;
+    }
+    _bytesUntilSample = nextSampleInterval();
+    if (ptr == NULL || _inProfiler)
+        return;
+
+    // backtrace() may itself call malloc the first time it runs
+    void *stack[PROF_MAX_DEPTH + PROF_MAX_SKIP];
+    _inProfiler = true;
+    int depth = backtrace(stack, PROF_MAX_DEPTH + PROF_MAX_SKIP);
+    _inProfiler = false;
+
+    // the stack starts at the caller of the allocator, however many of
+    // its functions the compiler kept out of line
+    int skip = 0;
+    while (skip < depth && isAllocatorText(stack[skip]))
+        skip++;
+    depth -= skip;
+    if (depth > PROF_MAX_DEPTH)
+        depth = PROF_MAX_DEPTH;
+
+    pthread_mutex_lock(&_profMutex);
+    if (_profBuckets == NULL) {
+        void *buckets = mmap(NULL, PROF_BUCKETS * sizeof(ProfBucket), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        void *samples = mmap(NULL, PROF_SAMPLES * sizeof(ProfSample), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buckets == MAP_FAILED || samples == MAP_FAILED) {
+            _profPath = NULL;
+            pthread_mutex_unlock(&_profMutex);
+            return;
+        }
+        _profBuckets = buckets;
+        _profSamples = samples;
+    }
+    if (_profLiveSamples >= PROF_SAMPLES / 2) {
+        // table too full to probe cheaply; drop this sample
+        pthread_mutex_unlock(&_profMutex);
+        return;
+    }
+
+    ProfBucket *bucket = findBucket(stack + skip, depth);
+    bucket->_allocs++;
+    bucket->_allocBytes += size;
+
+    size_t i = hashPointer(ptr) & (PROF_SAMPLES - 1);
+    while (_profSamples[i]._ptr != NULL)
+        i = (i + 1) & (PROF_SAMPLES - 1);
+    _profSamples[i]._ptr = ptr;
+    _profSamples[i]._bucket = bucket;
+    _profSamples[i]._size = size;
+    _profLiveSamples++;
+
+    // slab objects have no tag to mark; their slab counts them instead
+    FreeObject *o = (FreeObject *) ((char *) ptr - sizeof(BoundaryTag));
+    if (isSlabObject(ptr))
+        __atomic_add_fetch(&slabOf(ptr)->_sampled, 1, __ATOMIC_RELAXED);
+    else
+        setSampled(&o->boundary_tag);
+    pthread_mutex_unlock(&_profMutex);
+}
+
+/**
+ * @brief Counts one allocation against the sampling countdown
+ */
+static inline MYMALLOC_TEXT void profileAllocation(void *ptr, size_t size) {
+    if (__builtin_expect((_bytesUntilSample -= (ssize_t) size) < 0, 0))
+        sampleAllocation(ptr, size);
+}
+
+/**
+ * @brief Counts the sample in slot i as freed and removes it. Called with
+ * _profMutex held.
+ */
+static void removeSample(size_t i) {
+    _profSamples[i]._bucket->_frees++;
+    _profSamples[i]._bucket->_freeBytes += _profSamples[i]._size;
+    _profSamples[i]._ptr = NULL;
+    _profLiveSamples--;
+
+    // backward-shift deletion keeps linear probing free of tombstones
+    size_t hole = i;
+    for (size_t j = (i + 1) & (PROF_SAMPLES - 1); _profSamples[j]._ptr != NULL;
+         j = (j + 1) & (PROF_SAMPLES - 1)) {
+        size_t home = hashPointer(_profSamples[j]._ptr) & (PROF_SAMPLES - 1);
+        if (((j - home) & (PROF_SAMPLES - 1)) >= ((j - hole) & (PROF_SAMPLES - 1))) {
+            _profSamples[hole] = _profSamples[j];
+            _profSamples[j]._ptr = NULL;
+            hole = j;
+        }
+    }
+}
+
+/**
+ * @brief Drops the live sample of an object that is being freed
+ */
+static void unsampleAllocation(void *ptr) {
+    pthread_mutex_lock(&_profMutex);
+    size_t i = hashPointer(ptr) & (PROF_SAMPLES - 1);
+    while (_profSamples[i]._ptr != NULL && _profSamples[i]._ptr != ptr)
+        i = (i + 1) & (PROF_SAMPLES - 1);
+    if (_profSamples[i]._ptr == NULL) {
+        pthread_mutex_unlock(&_profMutex);
+        return;
+    }
+    removeSample(i);
+    FreeObject *o = (FreeObject *) ((char *) ptr - sizeof(BoundaryTag));
+    if (isSlabObject(ptr))
+        __atomic_sub_fetch(&slabOf(ptr)->_sampled, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&_profMutex);
+
+    if (!isSlabObject(ptr))
+        o->boundary_tag._objectSizeAndAlloc &= ~(size_t) 2;
+}
+
+/**
+ * @brief Whether ptr may have a live sample; slab objects have no tag
+ * and are looked up when their slab has any sampled object
+ */
+static inline bool isSampledObject(void *ptr) {
+    if (isSlabObject(ptr))
+        return __atomic_load_n(&slabOf(ptr)->_sampled, __ATOMIC_RELAXED) != 0;
+    return isSampled(&((FreeObject *) ((char *) ptr - sizeof(BoundaryTag)))->boundary_tag);
+}
+
+/**
+ * @brief Moves the live sample of an object resized in place to its new
+ * size, so the bytes of its site stay right when it is freed
+ */
+static void resizeSample(void *ptr, size_t size) {
+    pthread_mutex_lock(&_profMutex);
+    size_t i = hashPointer(ptr) & (PROF_SAMPLES - 1);
+    while (_profSamples[i]._ptr != NULL && _profSamples[i]._ptr != ptr)
+        i = (i + 1) & (PROF_SAMPLES - 1);
+    if (_profSamples[i]._ptr != NULL) {
+        _profSamples[i]._bucket->_allocBytes += size - _profSamples[i]._size;
+        _profSamples[i]._size = size;
+    }
+    pthread_mutex_unlock(&_profMutex);
+}
+
+static void writeProfileBucket(int fd, ProfBucket *b) {
+    char line[64 + PROF_MAX_DEPTH * 20];
+    int len = snprintf(line, sizeof(line), "%6zu: %8zu [%6zu: %8zu] @",
+                       b->_allocs - b->_frees, b->_allocBytes - b->_freeBytes,
+                       b->_allocs, b->_allocBytes);
+    for (int i = 0; i < b->_depth; i++)
+        len += snprintf(line + len, sizeof(line) - len, " %p", b->_stack[i]);
+    line[len++] = '\n';
+    write(fd, line, len);
+}
+
+int heap_profile_dump(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    sig_atomic_t outer = enterAllocator();
+    pthread_mutex_lock(&_profMutex);
+    ProfBucket total = _profOverflowBucket;
+    for (size_t i = 0; _profBuckets != NULL && i < PROF_BUCKETS; i++) {
+        total._allocs += _profBuckets[i]._allocs;
+        total._allocBytes += _profBuckets[i]._allocBytes;
+        total._frees += _profBuckets[i]._frees;
+        total._freeBytes += _profBuckets[i]._freeBytes;
+    }
+    char header[128];
+    int len = snprintf(header, sizeof(header),
+                       "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+                       total._allocs - total._frees, total._allocBytes - total._freeBytes,
+                       total._allocs, total._allocBytes, _profSampleRate);
+    write(fd, header, len);
+    for (size_t i = 0; _profBuckets != NULL && i < PROF_BUCKETS; i++) {
+        if (_profBuckets[i]._depth != 0)
+            writeProfileBucket(fd, &_profBuckets[i]);
+    }
+    if (_profOverflowBucket._allocs != 0)
+        writeProfileBucket(fd, &_profOverflowBucket);
+    pthread_mutex_unlock(&_profMutex);
+    leaveAllocator(outer);
+
+    // pprof needs the mappings to symbolize the addresses
+    const char *maps = "\nMAPPED_LIBRARIES:\n";
+    write(fd, maps, strlen(maps));
+    int mapsFd = open("/proc/self/maps", O_RDONLY);
+    if (mapsFd >= 0) {
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(mapsFd, buf, sizeof(buf))) > 0)
+            write(fd, buf, n);
+        close(mapsFd);
+    }
+    return close(fd);
+}
+
+//
+// Allocation trace recorder
+//
+// With MYMALLOC_TRACE=<file> every call of the C interface, the named heap
+// API and the extended API is logged into a ring buffer owned by the
+// calling thread; the records do not say which heap an object came from. The owner is the only producer.
+// Whoever flushes (the owner when its ring is full, or malloc_trace_flush())
+// copies the pending records out and claims them with a CAS on the tail, so
+// neither side takes a lock. Each flushed block is appended with pwrite() at
+// an atomically reserved file offset.
+//
+
+#define TRACE_RING_SIZE 4096    // records per thread, power of 2
+#define TRACE_FLUSH_BATCH 256   // records copied out per flush step
+
+typedef struct TraceBuffer {
+    _Atomic uint64_t _head;     // records written by the owner
+    _Atomic uint64_t _tail;     // records flushed
+    uint16_t _thread;
+    struct TraceBuffer *_next;
+    TraceRecord _records[TRACE_RING_SIZE];
+} TraceBuffer;
+
+static _Atomic(TraceBuffer *) _traceBuffers;
+static atomic_uint _traceThreads;
+static __thread TraceBuffer *_traceBuffer __attribute__((tls_model("initial-exec")));
+
+/**
+ * @brief Writes out every record of b that has not been flushed yet
+ */
+static void flushTraceBuffer(TraceBuffer *b) {
+    TraceRecord batch[TRACE_FLUSH_BATCH];
+    for (;;) {
+        uint64_t tail = atomic_load(&b->_tail);
+        uint64_t head = atomic_load_explicit(&b->_head, memory_order_acquire);
+        if (tail == head)
+            return;
+        uint64_t n = head - tail;
+        if (n > TRACE_FLUSH_BATCH)
+            n = TRACE_FLUSH_BATCH;
+        for (uint64_t i = 0; i < n; i++)
+            batch[i] = b->_records[(tail + i) & (TRACE_RING_SIZE - 1)];
+        // another flusher got there first; its copy is the one written
+        if (!atomic_compare_exchange_strong(&b->_tail, &tail, tail + n))
+            continue;
+        off_t offset = atomic_fetch_add(&_traceOffset, n * sizeof(TraceRecord));
+        pwrite(_traceFd, batch, n * sizeof(TraceRecord), offset);
+    }
+}
+
+/**
+ * @brief Appends one record to the calling thread's ring
+ */
+static void traceEvent(uint8_t op, void *ptr, void *oldPtr, size_t size) {
+    TraceBuffer *b = _traceBuffer;
+    if (b == NULL) {
+        b = mmap(NULL, sizeof(TraceBuffer), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b == MAP_FAILED)
+            return;
+        b->_thread = (uint16_t) atomic_fetch_add(&_traceThreads, 1);
+        b->_next = atomic_load(&_traceBuffers);
+        while (!atomic_compare_exchange_weak(&_traceBuffers, &b->_next, b))
+            ;
+        _traceBuffer = b;
+    }
+
+    uint64_t head = atomic_load_explicit(&b->_head, memory_order_relaxed);
+    if (head - atomic_load(&b->_tail) == TRACE_RING_SIZE)
+        flushTraceBuffer(b);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    TraceRecord *r = &b->_records[head & (TRACE_RING_SIZE - 1)];
+    r->_timestamp = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+    r->_ptr = (uintptr_t) ptr;
+    r->_oldPtr = (uintptr_t) oldPtr;
+    r->_size = size > UINT32_MAX ? UINT32_MAX : (uint32_t) size;
+    r->_thread = b->_thread;
+    r->_op = op;
+    r->_pad = 0;
+    atomic_store_explicit(&b->_head, head + 1, memory_order_release);
+}
+
+void malloc_trace_flush() {
+    if (_traceFd < 0)
+        return;
+    for (TraceBuffer *b = atomic_load(&_traceBuffers); b != NULL; b = b->_next)
+        flushTraceBuffer(b);
+}
+
+void print() {
+    printf("\n-------------------\n");
+
+    printf("HeapSize:\t%zd bytes\n", _heapSize);
+    printf("# mallocs:\t%d\n", _mallocCalls);
+    printf("# reallocs:\t%d\n", _reallocCalls);
+    printf("# callocs:\t%d\n", _callocCalls);
+    printf("# frees:\t%d\n", _freeCalls);
+
+    printf("\n-------------------\n");
+}
+
+void print_list() {
+    printf("FreeList: ");
+    if (!_initialized)
+        initialize();
+    FreeObject *ptr = _freeList->free_list_node._next;
+    while (ptr != _freeList) {
+        long offset = (long) ptr - (long) _memStart;
+        printf("[offset:%ld,size:%zd]", offset, getSize(&ptr->boundary_tag));
+        ptr = ptr->free_list_node._next;
+        if (ptr != NULL)
+            printf("->");
+    }
+    printf("\n");
+}
+
+/**
+ * @return the resident set size of the process in bytes, 0 if unknown
+ */
+static size_t residentBytes() {
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0)
+        return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    unsigned long pages = 0, resident = 0;
+    sscanf(buf, "%lu %lu", &pages, &resident);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void addSlabStats(MallocStats *stats);
+
+void heap_get_stats(Heap *heap, MallocStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    sig_atomic_t outer = enterAllocator();
+    pthread_mutex_lock(&heap->_mutex);
+    if (!_initialized)
+        initialize();
+    stats->_heapSize = heap->_heapSize;
+    stats->_requestedBytes = heap->_requestedBytes;
+    stats->_allocatedBytes = heap->_allocatedBytes;
+    stats->_freeBytes = heap->_freeBytes;
+    for (FreeObject *ptr = heap->_freeList->free_list_node._next; ptr != heap->_freeList;
+         ptr = ptr->free_list_node._next) {
+        size_t size = getSize(&ptr->boundary_tag);
+        if (size > stats->_largestFreeBlock)
+            stats->_largestFreeBlock = size;
+        int sizeClass = 0;
+        while (sizeClass < MALLOC_STATS_CLASSES - 1 && size >= (64UL << sizeClass))
+            sizeClass++;
+        stats->_freeBlocksPerClass[sizeClass]++;
+        stats->_freeBlocks++;
+    }
+    pthread_mutex_unlock(&heap->_mutex);
+
+    stats->_residentBytes = residentBytes();
+
+    pthread_mutex_lock(&_chunkCacheMutex);
+    stats->_cachedChunks = _cachedChunks;
+    for (size_t i = 0; i < _cachedChunks; i++)
+        stats->_cachedBytes += _chunkCache[i]._size;
+    stats->_chunkCacheHits = _chunkCacheHits;
+    stats->_chunkCacheMisses = _chunkCacheMisses;
+    pthread_mutex_unlock(&_chunkCacheMutex);
+
+    if (heap == &_defaultHeap)
+        addSlabStats(stats);
+    leaveAllocator(outer);
+}
+
+void get_malloc_stats(MallocStats *stats) {
+    heap_get_stats(&_defaultHeap, stats);
+}
+
+void print_stats() {
+    MallocStats stats;
+    get_malloc_stats(&stats);
+
+    // internal: allocated block bytes not asked for; external: free bytes
+    // outside the largest free block
+    double internal = stats._allocatedBytes ?
+        1.0 - (double) stats._requestedBytes / stats._allocatedBytes : 0.0;
+    double external = stats._freeBytes ?
+        1.0 - (double) stats._largestFreeBlock / stats._freeBytes : 0.0;
+
+    fprintf(stderr, "\n------ heap stats ------\n");
+    fprintf(stderr, "HeapSize:\t%zu bytes\n", stats._heapSize);
+    fprintf(stderr, "Requested:\t%zu bytes\n", stats._requestedBytes);
+    fprintf(stderr, "Allocated:\t%zu bytes\n", stats._allocatedBytes);
+    fprintf(stderr, "Free:\t\t%zu bytes in %zu blocks\n", stats._freeBytes, stats._freeBlocks);
+    fprintf(stderr, "Largest free:\t%zu bytes\n", stats._largestFreeBlock);
+    fprintf(stderr, "RSS:\t\t%zu bytes\n", stats._residentBytes);
+    if (_slabRegionSize != 0)
+        fprintf(stderr, "Slabs:\t\t%zu bytes, %zu in objects\n", stats._slabBytes, stats._slabObjectBytes);
+    size_t chunkRequests = stats._chunkCacheHits + stats._chunkCacheMisses;
+    fprintf(stderr, "Chunk cache:\t%zu chunks, %zu bytes, %zu/%zu hits (%.1f%%)\n",
+            stats._cachedChunks, stats._cachedBytes, stats._chunkCacheHits, chunkRequests,
+            chunkRequests ? 100.0 * stats._chunkCacheHits / chunkRequests : 0.0);
+    fprintf(stderr, "Internal frag:\t%.1f%%\n", 100 * internal);
+    fprintf(stderr, "External frag:\t%.1f%%\n", 100 * external);
+    for (int i = 0; i < MALLOC_STATS_CLASSES; i++) {
+        if (stats._freeBlocksPerClass[i] == 0)
+            continue;
+        if (i == MALLOC_STATS_CLASSES - 1)
+            fprintf(stderr, "  free [%lu, inf):\t%zu\n", 32UL << i, stats._freeBlocksPerClass[i]);
+        else
+            fprintf(stderr, "  free [%lu, %lu):\t%zu\n", 32UL << i, 64UL << i, stats._freeBlocksPerClass[i]);
+    }
+    fprintf(stderr, "------------------------\n");
+}
+
+// Slab objects are counted without the heap mutex
+void increaseMallocCalls() { __atomic_add_fetch(&_mallocCalls, 1, __ATOMIC_RELAXED); }
+
+void increaseReallocCalls() { __atomic_add_fetch(&_reallocCalls, 1, __ATOMIC_RELAXED); }
+
+void increaseCallocCalls() { __atomic_add_fetch(&_callocCalls, 1, __ATOMIC_RELAXED); }
+
+void increaseFreeCalls() { __atomic_add_fetch(&_freeCalls, 1, __ATOMIC_RELAXED); }
+
+//
+// Maintenance thread
+//
+// With MYMALLOC_BACKGROUND=<ms> a thread wakes up every <ms> milliseconds
+// and does the housekeeping that would otherwise land on malloc and free:
+// it coalesces quick lists that were not drawn from since its last pass,
+// gives the pages inside large free blocks back to the OS, returns the
+// objects of depot magazines that nobody took to the slabs, releases
+// abandoned pages that have become empty, unmaps cached
+// chunks whose time is up, and reserves and faults in the next chunk of
+// the default heap before it is needed.
+//
+
+// Free blocks at least this large have their inner pages purged
+#define PURGE_MIN_BLOCK (64 * 1024)
+
+// Bytes purged per pass at most
+#define PURGE_MAX_BYTES (16 * 1024 * 1024)
+
+// Free blocks taken out of the heap at a time to be purged
+#define PURGE_BATCH 64
+
+// Quick list blocks coalesced per acquisition of the heap mutex
+#define QUICK_FLUSH_BATCH 1024
+
+// Reserve a spare chunk once less than this much of the heap is free
+#define SPARE_CHUNK_THRESHOLD (ARENA_SIZE / 2)
+
+// Bit 63 marks free blocks whose pages were given back to the OS. Only
+// allocated objects have padding in the top byte, and rewriting the size
+// or the allocated bit clears it.
+#define PURGED_BIT (1UL << 63)
+#define isPurged(obj)   (((obj)->_objectSizeAndAlloc) & PURGED_BIT)
+#define setPurged(obj)  ((obj)->_objectSizeAndAlloc |= PURGED_BIT)
+
+/**
+ * @brief Coalesces up to QUICK_FLUSH_BATCH blocks of the quick lists of
+ * heap. Called with the heap mutex held.
+ *
+ * @return true if the quick lists are empty
+ */
+static bool flushQuickListsBatch(Heap *heap) {
+    size_t n = 0;
+    for (size_t i = 0; i < HEAP_QUICK_LISTS; i++) {
+        while (heap->_quickLists[i] != NULL) {
+            if (n++ == QUICK_FLUSH_BATCH)
+                return false;
+            FreeObject *o = heap->_quickLists[i];
+            heap->_quickLists[i] = o->free_list_node._next;
+            heap->_quickBytes -= getSize(&o->boundary_tag);
+            coalesceObject(heap, o);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Puts a block that was taken out to be purged back into the heap.
+ * A neighbour freed in the meantime could not merge with it, so it is
+ * coalesced now; the merged block is not marked purged.
+ */
+static void returnPurgedBlock(Heap *heap, FreeObject *o) {
+    size_t size = getSize(&o->boundary_tag);
+    if (isLeftFree(&o->boundary_tag) || !isAllocated(rightTag(o))) {
+        coalesceObject(heap, o);
+        return;
+    }
+    // a whole empty chunk was counted in _emptyChunks before
+    setAllocated(&o->boundary_tag, NOT_ALLOCATED);
+    setPurged(&o->boundary_tag);
+    insertFreeObject(heap, o);
+    setLeftTag(rightTag(o), size, true);
+}
+
+/**
+ * @brief Gives the whole pages inside large free blocks back to the OS.
+ * The free block header and, with compact tags, the footer stay in place.
+ * The blocks are taken out of the heap in batches, marked allocated so
+ * that nobody hands them out or merges with them, and purged without the
+ * heap mutex.
+ */
+static void purgeFreeBlocks(Heap *heap) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t purged = 0;
+    FreeObject *batch[PURGE_BATCH];
+    size_t n;
+    do {
+        size_t bytes = 0;
+        n = 0;
+        pthread_mutex_lock(&heap->_mutex);
+        FreeObject *ptr = heap->_freeList->free_list_node._next;
+        while (ptr != heap->_freeList && n < PURGE_BATCH && purged + bytes < PURGE_MAX_BYTES) {
+            FreeObject *next = ptr->free_list_node._next;
+            size_t size = getSize(&ptr->boundary_tag);
+            if (size >= PURGE_MIN_BLOCK && !isPurged(&ptr->boundary_tag)) {
+                removeFreeObject(ptr);
+                setAllocated(&ptr->boundary_tag, ALLOCATED);
+                setLeftTag(rightTag(ptr), size, false);
+                batch[n++] = ptr;
+                bytes += size;
+            }
+            ptr = next;
+        }
+        pthread_mutex_unlock(&heap->_mutex);
+
+        for (size_t i = 0; i < n; i++) {
+            uintptr_t start = ((uintptr_t) (batch[i] + 1) + pageSize - 1) & ~(pageSize - 1);
+            uintptr_t end = ((uintptr_t) rightTag(batch[i]) - sizeof(size_t)) & ~(pageSize - 1);
+            if (end > start && madvise((void *) start, end - start, MADV_DONTNEED) == 0)
+                purged += end - start;
+        }
+
+        pthread_mutex_lock(&heap->_mutex);
+        for (size_t i = 0; i < n; i++)
+            returnPurgedBlock(heap, batch[i]);
+        pthread_mutex_unlock(&heap->_mutex);
+    } while (n == PURGE_BATCH && purged < PURGE_MAX_BYTES);
+}
+
+/**
+ * @brief Reserves the next chunk of the default heap and faults its pages
+ * in while nobody can see it, then publishes it as the spare chunk
+ */
+static void reserveSpareChunk(Heap *heap) {
+    pthread_mutex_lock(&heap->_mutex);
+    bool needed = heap->_spareChunk == NULL && heap->_freeBytes - heap->_quickBytes < SPARE_CHUNK_THRESHOLD;
+    pthread_mutex_unlock(&heap->_mutex);
+    if (!needed)
+        return;
+
+    char *mem = requestChunk(heap, ARENA_SIZE);
+    if (mem == NULL)
+        return;
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    for (char *page = mem; page < mem + ARENA_SIZE; page += pageSize)
+        *(volatile char *) page = 0;
+
+    pthread_mutex_lock(&heap->_mutex);
+    FreeObject *chunk = addChunk(heap, mem, ARENA_SIZE);
+    if (heap->_spareChunk == NULL)
+        heap->_spareChunk = chunk;
+    else {
+        insertFreeObject(heap, chunk);
+        heap->_emptyChunks++;
+    }
+    pthread_mutex_unlock(&heap->_mutex);
+}
+
+static void trimDepots(size_t *lastTaken);
+static void reclaimAbandonedPages();
+
+static void *maintenanceThread(void *arg) {
+    Heap *heap = &_defaultHeap;
+    size_t lastQuickHits = 0;
+    size_t lastDepotTaken[SLAB_CLASSES] = { 0 };
+    struct timespec interval = { _maintenanceInterval / 1000, (_maintenanceInterval % 1000) * 1000000 };
+
+    // the thread holds the allocator's locks without _inMalloc, so no
+    // handler may run on it
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    for (;;) {
+        nanosleep(&interval, NULL);
+
+        // the heap mutex is dropped between batches, so malloc and free
+        // do not wait for the whole flush
+        pthread_mutex_lock(&heap->_mutex);
+        if (heap->_quickBytes > 0 && heap->_quickHits == lastQuickHits) {
+            while (!flushQuickListsBatch(heap)) {
+                pthread_mutex_unlock(&heap->_mutex);
+                sched_yield();
+                pthread_mutex_lock(&heap->_mutex);
+            }
+        }
+        lastQuickHits = heap->_quickHits;
+        pthread_mutex_unlock(&heap->_mutex);
+
+        purgeFreeBlocks(heap);
+        if (_magazines)
+            trimDepots(lastDepotTaken);
+        if (_pageFreeLists)
+            reclaimAbandonedPages();
+
+        pthread_mutex_lock(&_chunkCacheMutex);
+        expireCachedChunks();
+        pthread_mutex_unlock(&_chunkCacheMutex);
+
+        reserveSpareChunk(heap);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts the maintenance thread when the program is loaded, outside
+ * of any malloc call, since creating a thread allocates. Without
+ * MYMALLOC_BACKGROUND the heap is left untouched until the first malloc.
+ */
+__attribute__((constructor)) static void startMaintenanceThread() {
+    const char *interval = getenv("MYMALLOC_BACKGROUND");
+    if (interval == NULL || (_maintenanceInterval = strtoul(interval, NULL, 10)) == 0)
+        return;
+    const char *cpu = getenv("MYMALLOC_BACKGROUND_CPU");
+    if (cpu != NULL)
+        _maintenanceCpu = atoi(cpu);
+
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    if (!_initialized)
+        initialize();
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (_maintenanceCpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(_maintenanceCpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, maintenanceThread, NULL) != 0)
+        _maintenanceInterval = 0;
+    pthread_attr_destroy(&attr);
+}
+
+//
+// Slabs
+//
+// With MYMALLOC_SLABS, requests of 1 to SIZE_CLASS_MAX bytes are
+// served from slabs instead of the heap. Every class has its own lock and
+// list of partial slabs; taking a slot is a scan of the slab's free map
+// for a set bit, and a batch takes every free slot of a map word at once.
+// A slab whose last object is freed gives its pages back to the OS and
+// can be reused by any class.
+//
+
+static SlabClass _slabClasses[SLAB_CLASSES] = {
+    [0 ... SLAB_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL }
+};
+
+// Slabs never used yet start at _slabsUsed; emptied slabs wait in
+// _emptySlabs
+static size_t _slabsUsed;
+static Slab *_emptySlabs;
+static pthread_mutex_t _slabMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline bool useSlab(size_t size) {
+    return _slabRegionSize != 0 && size - 1 < SIZE_CLASS_MAX;
+}
+
+/**
+ * @return the slab class of a request of size bytes. With
+ * MYMALLOC_CACHE_LINES a request of more than half a cache line is padded
+ * to whole lines; those classes are multiples of CACHE_LINE, so their
+ * objects start on a line.
+ */
+static inline unsigned slabClass(size_t size) {
+    if (_cacheLines && size > CACHE_LINE / 2)
+        size = (size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+    return sizeClass(size);
+}
+
+static inline char *slabPages(Slab *slab) {
+    return _slabBase + (slab - _slabs) * SLAB_SPAN;
+}
+
+#ifdef __x86_64__
+/**
+ * @brief findFreeSlot() for CPUs with AVX2, which skips full halves of
+ * the map 256 bits at a time. Built for AVX2 whatever the compiler flags,
+ * and only called when the CPU has it.
+ */
+__attribute__((target("avx2"))) static int findFreeSlotAVX2(const uint64_t *map) {
+    for (int i = 0; i < SLAB_MAP_WORDS; i += 4) {
+        __m256i words = _mm256_load_si256((const __m256i *) (map + i));
+        if (_mm256_testz_si256(words, words))
+            continue;
+        for (int j = i;; j++) {
+            if (map[j] != 0)
+                return j * 64 + __builtin_ctzll(map[j]);
+        }
+    }
+    return -1;
+}
+#endif
+
+/**
+ * @return the index of the first free slot in map, or -1 if it is full
+ */
+static inline int findFreeSlot(const uint64_t *map) {
+#ifdef __x86_64__
+    if (_avx2)
+        return findFreeSlotAVX2(map);
+#endif
+    for (int i = 0; i < SLAB_MAP_WORDS; i++) {
+        if (map[i] != 0)
+            return i * 64 + __builtin_ctzll(map[i]);
+    }
+    return -1;
+}
+
+static void pushPartialSlab(SlabClass *class, Slab *slab) {
+    slab->_prev = NULL;
+    slab->_next = class->_partial;
+    if (class->_partial != NULL)
+        class->_partial->_prev = slab;
+    class->_partial = slab;
+}
+
+static void unlinkPartialSlab(SlabClass *class, Slab *slab) {
+    if (slab->_prev != NULL)
+        slab->_prev->_next = slab->_next;
+    else
+        class->_partial = slab->_next;
+    if (slab->_next != NULL)
+        slab->_next->_prev = slab->_prev;
+}
+
+/**
+ * @return an emptied or never used slab, or NULL with errno set if the
+ * region is used up
+ */
+static Slab *takeSlab() {
+    pthread_mutex_lock(&_slabMutex);
+    Slab *slab = _emptySlabs;
+    if (slab != NULL)
+        _emptySlabs = slab->_next;
+    else if (_slabsUsed < SLAB_REGION_SIZE / SLAB_SPAN)
+        slab = &_slabs[_slabsUsed++];
+    pthread_mutex_unlock(&_slabMutex);
+    if (slab == NULL)
+        errno = ENOMEM;
+    return slab;
+}
+
+/**
+ * @brief Gives the pages of a slab none of whose objects is in use back
+ * to the OS and keeps the slab for any class
+ */
+static void releaseSlab(Slab *slab) {
+    madvise(slabPages(slab), SLAB_SPAN, MADV_DONTNEED);
+    pthread_mutex_lock(&_slabMutex);
+    slab->_next = _emptySlabs;
+    _emptySlabs = slab;
+    pthread_mutex_unlock(&_slabMutex);
+}
+
+/**
+ * @brief Sets up an empty or never used slab for class c and makes it the
+ * first partial slab of the class. Called with the class mutex held.
+ * @return the slab, or NULL with errno set if the region is used up
+ */
+static Slab *newSlab(unsigned c) {
+    Slab *slab = takeSlab();
+    if (slab == NULL)
+        return NULL;
+
+    unsigned objects = _classSlabObjects[c];
+    for (unsigned i = 0; i < SLAB_MAP_WORDS; i++) {
+        unsigned bits = objects > i * 64 ? objects - i * 64 : 0;
+        slab->_freeMap[i] = bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+    }
+    slab->_sizeClass = c;
+    slab->_freeSlots = objects;
+    slab->_sampled = 0;
+    pushPartialSlab(&_slabClasses[c], slab);
+    return slab;
+}
+
+/**
+ * @brief Takes up to n free slots of slab, a whole map word per step
+ * @return the number of slots taken, stored in ptrs
+ */
+static size_t claimSlots(Slab *slab, size_t n, void **ptrs) {
+    char *pages = slabPages(slab);
+    size_t size = _classSize[slab->_sizeClass];
+    size_t count = 0;
+    for (int i = 0; i < SLAB_MAP_WORDS && count < n; i++) {
+        uint64_t taken = slab->_freeMap[i];
+        if (taken == 0)
+            continue;
+        // keep only the lowest n - count free slots of the word
+        if ((size_t) __builtin_popcountll(taken) > n - count) {
+            uint64_t rest = taken;
+            for (size_t k = n - count; k > 0; k--)
+                rest &= rest - 1;
+            taken &= ~rest;
+        }
+        slab->_freeMap[i] &= ~taken;
+        for (; taken != 0; taken &= taken - 1)
+            ptrs[count++] = pages + (i * 64 + __builtin_ctzll(taken)) * size;
+    }
+    slab->_freeSlots -= count;
+    return count;
+}
+
+/**
+ * @brief Allocates up to n objects of size bytes from the slabs of its
+ * class under one lock acquisition
+ * @return the number of objects allocated, stored in ptrs
+ */
+static size_t slabMallocBatch(size_t size, size_t n, void **ptrs) {
+    unsigned c = slabClass(size);
+    SlabClass *class = &_slabClasses[c];
+    size_t count = 0;
+    pthread_mutex_lock(&class->_mutex);
+    while (count < n) {
+        Slab *slab = class->_partial;
+        if (slab == NULL && (slab = newSlab(c)) == NULL)
+            break;
+        count += claimSlots(slab, n - count, ptrs + count);
+        if (slab->_freeSlots == 0)
+            unlinkPartialSlab(class, slab);
+    }
+    pthread_mutex_unlock(&class->_mutex);
+    return count;
+}
+
+/**
+ * @brief Gives n objects of class c back to their slabs under one lock
+ * acquisition
+ */
+static void slabFreeBatch(unsigned c, void **ptrs, size_t n) {
+    SlabClass *class = &_slabClasses[c];
+    Slab *emptied = NULL;
+    pthread_mutex_lock(&class->_mutex);
+    for (size_t i = 0; i < n; i++) {
+        Slab *slab = slabOf(ptrs[i]);
+        size_t slot = (size_t) ((char *) ptrs[i] - slabPages(slab)) / _classSize[c];
+        if (slab->_freeMap[slot / 64] & (1ULL << (slot % 64))) {
+            // double free
+            continue;
+        }
+        slab->_freeMap[slot / 64] |= 1ULL << (slot % 64);
+        if (slab->_freeSlots++ == 0)
+            pushPartialSlab(class, slab);
+
+        // keep the last partial slab of the class even when it is empty
+        if (slab->_freeSlots == _classSlabObjects[c] && (class->_partial != slab || slab->_next != NULL)) {
+            unlinkPartialSlab(class, slab);
+            slab->_next = emptied;
+            emptied = slab;
+        }
+    }
+    pthread_mutex_unlock(&class->_mutex);
+
+    while (emptied != NULL) {
+        Slab *next = emptied->_next;
+        releaseSlab(emptied);
+        emptied = next;
+    }
+}
+
+//
+// Magazines
+//
+// With MYMALLOC_MAGAZINES as well, every thread keeps two magazines per
+// slab class, a loaded one and the previous one: arrays of up to
+// MAGAZINE_ROUNDS objects that malloc pops from and free pushes to without
+// any lock. When both are empty (or both full) the thread trades a whole
+// magazine with the class depot, a set of slots that a magazine leaves or
+// enters with one atomic exchange, so a batch of objects moves from a
+// freeing thread to an allocating one in O(1). Only when the depot has no
+// full magazine does a thread fill one from the slabs, and only when it
+// has no free slot are a magazine's objects given back to them.
+//
+
+_Static_assert(SLAB_CLASSES == SIZE_CLASSES, "one magazine pair per slab class");
+
+static Depot _depots[SLAB_CLASSES];
+
+static __thread MagazineCache *_magazineCache;
+static pthread_key_t _magazineKey;
+static pthread_once_t _magazineKeyOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * @return a magazine taken out of one of slots, or NULL if they are all
+ * empty
+ */
+static Magazine *depotTake(Magazine **slots) {
+    for (int i = 0; i < DEPOT_SLOTS; i++) {
+        if (__atomic_load_n(&slots[i], __ATOMIC_RELAXED) == NULL)
+            continue;
+        Magazine *m = __atomic_exchange_n(&slots[i], NULL, __ATOMIC_ACQUIRE);
+        if (m != NULL)
+            return m;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Puts m into a free one of slots
+ * @return false if there is none
+ */
+static bool depotPut(Magazine **slots, Magazine *m) {
+    for (int i = 0; i < DEPOT_SLOTS; i++) {
+        Magazine *expected = NULL;
+        if (__atomic_compare_exchange_n(&slots[i], &expected, m, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @return an empty magazine from the depot of class c or the heap, or NULL
+ */
+static Magazine *emptyMagazine(unsigned c) {
+    Magazine *m = depotTake(_depots[c]._empty);
+    if (m != NULL)
+        return m;
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    m = allocateObject(&_defaultHeap, sizeof(Magazine));
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+    if (m != NULL)
+        m->_rounds = 0;
+    return m;
+}
+
+/**
+ * @brief Gives the objects in m back to the slabs and keeps m in the
+ * depot of class c, or frees it if the depot has no room
+ */
+static void retireMagazine(unsigned c, Magazine *m) {
+    if (m->_rounds != 0)
+        slabFreeBatch(c, m->_objects, m->_rounds);
+    m->_rounds = 0;
+    if (depotPut(_depots[c]._empty, m))
+        return;
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    freeObject(&_defaultHeap, m);
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+}
+
+/**
+ * @brief Thread exit: full magazines go to the depot for other threads,
+ * the objects of the others go back to the slabs
+ */
+static void flushMagazineCache(void *arg) {
+    MagazineCache *cache = arg;
+    sig_atomic_t outer = enterAllocator();
+    _magazineCache = NULL;
+    for (unsigned c = 0; c < SLAB_CLASSES; c++) {
+        Magazine *ms[2] = { cache->_loaded[c], cache->_previous[c] };
+        for (int i = 0; i < 2; i++) {
+            if (ms[i] == NULL)
+                continue;
+            if (ms[i]->_rounds == MAGAZINE_ROUNDS && depotPut(_depots[c]._full, ms[i]))
+                continue;
+            retireMagazine(c, ms[i]);
+        }
+    }
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    freeObject(&_defaultHeap, cache);
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+    leaveAllocator(outer);
+}
+
+static void createMagazineKey() {
+    pthread_key_create(&_magazineKey, flushMagazineCache);
+}
+
+/**
+ * @return the magazines of the calling thread, or NULL if there is no
+ * memory for them
+ */
+static MagazineCache *getMagazineCache() {
+    MagazineCache *cache = _magazineCache;
+    if (__builtin_expect(cache != NULL, 1))
+        return cache;
+
+    pthread_once(&_magazineKeyOnce, createMagazineKey);
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    cache = allocateObject(&_defaultHeap, sizeof(MagazineCache));
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+    if (cache == NULL)
+        return NULL;
+    memset(cache, 0, sizeof(MagazineCache));
+    pthread_setspecific(_magazineKey, cache);
+    _magazineCache = cache;
+    return cache;
+}
+
+/**
+ * @return an object of class c from the calling thread's magazines, or
+ * NULL if neither they, the depot nor the slabs have one
+ */
+static void *magazineMalloc(unsigned c) {
+    MagazineCache *cache = getMagazineCache();
+    if (cache == NULL)
+        return NULL;
+    Magazine *m = cache->_loaded[c];
+    if (m == NULL || m->_rounds == 0) {
+        Magazine *p = cache->_previous[c];
+        if (p != NULL && p->_rounds > 0) {
+            cache->_previous[c] = m;
+            cache->_loaded[c] = m = p;
+        } else if ((p = depotTake(_depots[c]._full)) != NULL) {
+            __atomic_add_fetch(&_depots[c]._fullTaken, 1, __ATOMIC_RELAXED);
+            // the previous magazine is empty: it goes back to the depot
+            if (cache->_previous[c] != NULL)
+                retireMagazine(c, cache->_previous[c]);
+            cache->_previous[c] = m;
+            cache->_loaded[c] = m = p;
+        } else {
+            if (m == NULL && (m = cache->_loaded[c] = emptyMagazine(c)) == NULL)
+                return NULL;
+            m->_rounds = slabMallocBatch(_classSize[c], MAGAZINE_ROUNDS, m->_objects);
+            if (m->_rounds == 0)
+                return NULL;
+        }
+    }
+    return m->_objects[--m->_rounds];
+}
+
+/**
+ * @brief Puts ptr, an object of class c, into the calling thread's
+ * magazines
+ * @return false if there is no memory for a magazine
+ */
+static bool magazineFree(void *ptr, unsigned c) {
+    MagazineCache *cache = getMagazineCache();
+    if (cache == NULL)
+        return false;
+    Magazine *m = cache->_loaded[c];
+    if (m == NULL || m->_rounds == MAGAZINE_ROUNDS) {
+        Magazine *p = cache->_previous[c];
+        if (p != NULL && p->_rounds < MAGAZINE_ROUNDS) {
+            cache->_previous[c] = m;
+            cache->_loaded[c] = m = p;
+        } else {
+            // both full: the previous one goes to the depot whole, or its
+            // objects go back to the slabs if the depot has no room. The
+            // empty magazine is taken first: once p is in the depot,
+            // another thread may own it.
+            Magazine *empty = emptyMagazine(c);
+            if (p != NULL && (empty == NULL || !depotPut(_depots[c]._full, p))) {
+                if (empty != NULL)
+                    retireMagazine(c, empty);
+                slabFreeBatch(c, p->_objects, p->_rounds);
+                p->_rounds = 0;
+                empty = p;
+            } else if (empty == NULL) {
+                return false;
+            }
+            cache->_previous[c] = m;
+            cache->_loaded[c] = m = empty;
+        }
+    }
+    m->_objects[m->_rounds++] = ptr;
+    return true;
+}
+
+/**
+ * @brief Maintenance pass: gives the objects of the full magazines in the
+ * depot of every class that no thread took one from since the last pass
+ * back to the slabs
+ *
+ * @param lastTaken _fullTaken of each depot at the last pass
+ */
+static void trimDepots(size_t *lastTaken) {
+    for (unsigned c = 0; c < SLAB_CLASSES; c++) {
+        size_t taken = __atomic_load_n(&_depots[c]._fullTaken, __ATOMIC_RELAXED);
+        if (taken == lastTaken[c]) {
+            Magazine *m;
+            while ((m = depotTake(_depots[c]._full)) != NULL)
+                retireMagazine(c, m);
+        }
+        lastTaken[c] = taken;
+    }
+}
+
+//
+// Page free lists
+//
+// With MYMALLOC_PAGE_FREE_LISTS instead, slabs are pages owned by one
+// thread, in the style of mimalloc. Free objects are linked through their
+// first word, and each page has three lists: _free, which malloc pops
+// from; _localFree, which frees by the owner push to; and _threadFree,
+// which other threads push to atomically. malloc is a single pop from the
+// current page of the class. Only when _free runs out are the other two
+// lists collected into it, so the owner and the other threads never touch
+// the same list head while the page has objects to hand out. Pages of a
+// thread that exits are abandoned to their class and adopted by the next
+// thread that needs a page, or released once their objects are freed.
+//
+
+// Pages looked at before a thread starts a new one
+#define PAGE_SEARCH_LIMIT 4
+
+static __thread PageOwner *_pageOwner;
+static pthread_key_t _pageOwnerKey;
+static pthread_once_t _pageOwnerKeyOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Moves the objects other threads freed to the page's local list,
+ * then makes the local list the allocation list if that is empty
+ */
+static void collectPage(Slab *page) {
+    void *t = __atomic_exchange_n(&page->_threadFree, NULL, __ATOMIC_ACQUIRE);
+    while (t != NULL) {
+        void *next = *(void **) t;
+        *(void **) t = page->_localFree;
+        page->_localFree = t;
+        page->_used--;
+        t = next;
+    }
+    if (page->_free == NULL) {
+        page->_free = page->_localFree;
+        page->_localFree = NULL;
+    }
+}
+
+/**
+ * @brief Links page into a ring of pages right after prev, or makes it a
+ * ring of its own if prev is NULL
+ */
+static void linkPage(Slab *prev, Slab *page) {
+    if (prev == NULL) {
+        page->_next = page->_prev = page;
+        return;
+    }
+    page->_next = prev->_next;
+    page->_prev = prev;
+    prev->_next->_prev = page;
+    prev->_next = page;
+}
+
+/**
+ * @brief Adds page to the ring of pages of class c of owner, after prev,
+ * and makes it the current one
+ */
+static void ownPage(PageOwner *owner, unsigned c, Slab *prev, Slab *page) {
+    __atomic_store_n(&page->_owner, owner, __ATOMIC_RELAXED);
+    linkPage(prev, page);
+    owner->_pages[c] = page;
+}
+
+/**
+ * @brief Takes page out of the ring of class c of owner
+ */
+static void disownPage(PageOwner *owner, unsigned c, Slab *page) {
+    if (page->_next == page) {
+        owner->_pages[c] = NULL;
+    } else {
+        page->_prev->_next = page->_next;
+        page->_next->_prev = page->_prev;
+        if (owner->_pages[c] == page)
+            owner->_pages[c] = page->_next;
+    }
+}
+
+/**
+ * @brief Releases the abandoned pages whose objects have all been freed
+ * since. Adoption only looks at the first abandoned page of a class, so
+ * without this the others would wait for a thread to need a page of their
+ * class.
+ */
+static void reclaimAbandonedPages() {
+    for (unsigned c = 0; c < SLAB_CLASSES; c++) {
+        SlabClass *class = &_slabClasses[c];
+        if (__atomic_load_n(&class->_abandoned, __ATOMIC_RELAXED) == NULL)
+            continue;
+        Slab *empty = NULL;
+        pthread_mutex_lock(&class->_mutex);
+        for (Slab **link = &class->_abandoned; *link != NULL;) {
+            Slab *page = *link;
+            collectPage(page);
+            if (page->_used == 0) {
+                *link = page->_next;
+                page->_next = empty;
+                empty = page;
+            } else {
+                link = &page->_next;
+            }
+        }
+        pthread_mutex_unlock(&class->_mutex);
+        while (empty != NULL) {
+            Slab *next = empty->_next;
+            releaseSlab(empty);
+            empty = next;
+        }
+    }
+}
+
+/**
+ * @brief Thread exit: empty pages are released, the others are abandoned
+ * to their class with whatever other threads still have to free. Pages
+ * abandoned earlier that are empty by now are released as well.
+ */
+static void abandonPages(void *arg) {
+    PageOwner *owner = arg;
+    sig_atomic_t outer = enterAllocator();
+    _pageOwner = NULL;
+    for (unsigned c = 0; c < SLAB_CLASSES; c++) {
+        while (owner->_pages[c] != NULL) {
+            Slab *page = owner->_pages[c];
+            disownPage(owner, c, page);
+            collectPage(page);
+            if (page->_used == 0) {
+                releaseSlab(page);
+                continue;
+            }
+            SlabClass *class = &_slabClasses[c];
+            __atomic_store_n(&page->_owner, NULL, __ATOMIC_RELAXED);
+            pthread_mutex_lock(&class->_mutex);
+            page->_next = class->_abandoned;
+            class->_abandoned = page;
+            pthread_mutex_unlock(&class->_mutex);
+        }
+    }
+    reclaimAbandonedPages();
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    freeObject(&_defaultHeap, owner);
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+    leaveAllocator(outer);
+}
+
+static void createPageOwnerKey() {
+    pthread_key_create(&_pageOwnerKey, abandonPages);
+}
+
+static PageOwner *getPageOwner() {
+    PageOwner *owner = _pageOwner;
+    if (__builtin_expect(owner != NULL, 1))
+        return owner;
+
+    pthread_once(&_pageOwnerKeyOnce, createPageOwnerKey);
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    owner = allocateObject(&_defaultHeap, sizeof(PageOwner));
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+    if (owner == NULL)
+        return NULL;
+    memset(owner, 0, sizeof(PageOwner));
+    pthread_setspecific(_pageOwnerKey, owner);
+    _pageOwner = owner;
+    return owner;
+}
+
+/**
+ * @brief Finds a page of class c with a free object: one of the next
+ * PAGE_SEARCH_LIMIT pages of the owner once their freed objects are
+ * collected, an abandoned page, or a new one whose objects are all linked
+ * into its allocation list. A new or adopted page goes after the last page
+ * looked at, so the next search carries on round the ring from there.
+ * @return the page, now current, or NULL if the region is used up
+ */
+static Slab *findPage(PageOwner *owner, unsigned c) {
+    Slab *last = owner->_pages[c];
+    if (last != NULL) {
+        collectPage(last);
+        if (last->_free != NULL)
+            return last;
+        for (int i = 0; i < PAGE_SEARCH_LIMIT && last->_next != owner->_pages[c]; i++) {
+            last = last->_next;
+            collectPage(last);
+            if (last->_free != NULL) {
+                owner->_pages[c] = last;
+                return last;
+            }
+        }
+    }
+
+    SlabClass *class = &_slabClasses[c];
+    pthread_mutex_lock(&class->_mutex);
+    Slab *page = class->_abandoned;
+    if (page != NULL)
+        class->_abandoned = page->_next;
+    pthread_mutex_unlock(&class->_mutex);
+    if (page != NULL) {
+        ownPage(owner, c, last, page);
+        collectPage(page);
+        if (page->_free != NULL)
+            return page;
+        // everything still allocated: keep it and start a new page too
+        last = page;
+    }
+
+    if ((page = takeSlab()) == NULL)
+        return NULL;
+    char *pages = slabPages(page);
+    size_t size = _classSize[c];
+    unsigned objects = _classSlabObjects[c];
+    for (unsigned i = 0; i < objects; i++)
+        *(void **) (pages + i * size) = i + 1 < objects ? pages + (i + 1) * size : NULL;
+    page->_sizeClass = c;
+    page->_free = pages;
+    page->_localFree = NULL;
+    page->_threadFree = NULL;
+    page->_used = 0;
+    page->_sampled = 0;
+    ownPage(owner, c, last, page);
+    return page;
+}
+
+static void *pageMalloc(unsigned c) {
+    PageOwner *owner = getPageOwner();
+    if (owner == NULL)
+        return NULL;
+    Slab *page = owner->_pages[c];
+    if (__builtin_expect(page == NULL || page->_free == NULL, 0) && (page = findPage(owner, c)) == NULL)
+        return NULL;
+    void *ptr = page->_free;
+    page->_free = *(void **) ptr;
+    page->_used++;
+    return ptr;
+}
+
+static void pageFree(void *ptr) {
+    Slab *page = slabOf(ptr);
+    PageOwner *owner = _pageOwner;
+    if (owner != NULL && __atomic_load_n(&page->_owner, __ATOMIC_RELAXED) == owner) {
+        unsigned c = page->_sizeClass;
+        Slab *current = owner->_pages[c];
+        if (page != current && page->_free == NULL && page->_localFree == NULL) {
+            // a full page that has room again is looked at first
+            disownPage(owner, c, page);
+            linkPage(current, page);
+        }
+        *(void **) ptr = page->_localFree;
+        page->_localFree = ptr;
+        // an empty page other than the current one goes back to the slabs
+        if (--page->_used == 0 && page != current) {
+            disownPage(owner, c, page);
+            releaseSlab(page);
+        }
+        return;
+    }
+
+    void *head = __atomic_load_n(&page->_threadFree, __ATOMIC_RELAXED);
+    do {
+        *(void **) ptr = head;
+    } while (!__atomic_compare_exchange_n(&page->_threadFree, &head, ptr, true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Takes an object of class c from the class's partial slabs, past
+ * any magazine
+ */
+static void *slabClassMalloc(unsigned c) {
+    SlabClass *class = &_slabClasses[c];
+    pthread_mutex_lock(&class->_mutex);
+    Slab *slab = class->_partial;
+    if (slab == NULL && (slab = newSlab(c)) == NULL) {
+        pthread_mutex_unlock(&class->_mutex);
+        return NULL;
+    }
+    int slot = findFreeSlot(slab->_freeMap);
+    slab->_freeMap[slot / 64] &= ~(1ULL << (slot % 64));
+    if (--slab->_freeSlots == 0)
+        unlinkPartialSlab(class, slab);
+    pthread_mutex_unlock(&class->_mutex);
+    return slabPages(slab) + (size_t) slot * _classSize[c];
+}
+
+static void *slabMalloc(size_t size) {
+    unsigned c = slabClass(size);
+    if (_pageFreeLists)
+        return pageMalloc(c);
+    if (_magazines) {
+        void *ptr = magazineMalloc(c);
+        if (ptr != NULL)
+            return ptr;
+    }
+    return slabClassMalloc(c);
+}
+
+static void slabFree(void *ptr) {
+    if (_pageFreeLists) {
+        pageFree(ptr);
+        return;
+    }
+    unsigned c = slabOf(ptr)->_sizeClass;
+    if (_magazines && magazineFree(ptr, c))
+        return;
+    slabFreeBatch(c, &ptr, 1);
+}
+
+/**
+ * @return the usable size of ptr, a heap or slab object
+ */
+static size_t objectSize(void *ptr) {
+    if (isEmergencyObject(ptr))
+        return ((size_t) EMERGENCY_BLOCK_MIN << ((EmergencyBlock *) ptr - 1)->_class) - sizeof(EmergencyBlock);
+    if (isSlabObject(ptr))
+        return _classSize[slabOf(ptr)->_sizeClass];
+    FreeObject *o = (FreeObject *) ((char *) ptr - sizeof(BoundaryTag));
+    return getSize(&o->boundary_tag) - sizeof(BoundaryTag);
+}
+
+/**
+ * @brief free() of a slab object
+ */
+static void freeSlabObject(void *ptr) {
+    if (isSampledObject(ptr))
+        unsampleAllocation(ptr);
+    if (_traceFd >= 0)
+        traceEvent(TRACE_FREE, ptr, NULL, 0);
+    slabFree(ptr);
+}
+
+/**
+ * @brief realloc() when the old or the new object is a slab object. An
+ * object that stays in the same slab class is kept in place.
+ */
+static MYMALLOC_TEXT void *reallocSlabObject(void *ptr, size_t size) {
+    increaseReallocCalls();
+    if (ptr != NULL && isSlabObject(ptr) && useSlab(size) &&
+        slabClass(size) == slabOf(ptr)->_sizeClass) {
+        if (_traceFd >= 0)
+            traceEvent(TRACE_REALLOC, ptr, ptr, size);
+        return ptr;
+    }
+
+    void *newptr;
+    if (useSlab(size)) {
+        newptr = slabMalloc(size);
+    } else {
+        pthread_mutex_lock(&_defaultHeap._mutex);
+        newptr = allocateObject(&_defaultHeap, size);
+        pthread_mutex_unlock(&_defaultHeap._mutex);
+    }
+    if (_traceFd >= 0)
+        traceEvent(TRACE_REALLOC, newptr, ptr, size);
+
+    // as in realloc(), realloc(ptr, 0) frees the old object
+    if (ptr != NULL && (newptr != NULL || size == 0)) {
+        if (newptr != NULL) {
+            size_t sizeToCopy = objectSize(ptr);
+            memcpy(newptr, ptr, sizeToCopy < size ? sizeToCopy : size);
+        }
+        if (isSlabObject(ptr)) {
+            if (isSampledObject(ptr))
+                unsampleAllocation(ptr);
+            slabFree(ptr);
+        } else {
+            FreeObject *o = (FreeObject *) ((char *) ptr - sizeof(BoundaryTag));
+            if (isSampled(&o->boundary_tag))
+                unsampleAllocation(ptr);
+            pthread_mutex_lock(&_defaultHeap._mutex);
+            freeObject(&_defaultHeap, ptr);
+            pthread_mutex_unlock(&_defaultHeap._mutex);
+        }
+    }
+
+    profileAllocation(newptr, size);
+    return newptr;
+}
+
+/**
+ * @brief Adds the slabs that hold objects to the stats of the default
+ * heap. The counts are read without the class locks, so they may be a few
+ * objects off while other threads allocate.
+ */
+static void addSlabStats(MallocStats *stats) {
+    size_t slabs = __atomic_load_n(&_slabsUsed, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < slabs; i++) {
+        Slab *slab = &_slabs[i];
+        unsigned c = __atomic_load_n(&slab->_sizeClass, __ATOMIC_RELAXED);
+        size_t used = _pageFreeLists ? __atomic_load_n(&slab->_used, __ATOMIC_RELAXED)
+                                     : _classSlabObjects[c] - __atomic_load_n(&slab->_freeSlots, __ATOMIC_RELAXED);
+        if (used == 0 || used > _classSlabObjects[c])
+            continue;
+        stats->_slabBytes += _classSlabPages[c] * SLAB_PAGE_SIZE;
+        stats->_slabObjectBytes += used * _classSize[c];
+    }
+    stats->_heapSize += stats->_slabBytes;
+    stats->_allocatedBytes += stats->_slabObjectBytes;
+    stats->_requestedBytes += stats->_slabObjectBytes;
+}
+
+//
+// Emergency pool
+//
+// Every public entry point that can take a lock sets _inMalloc while it
+// runs. An allocation that finds it set comes from a signal handler that
+// interrupted the allocator on this thread, which may hold any of the
+// heap, slab or profiler locks, so it is served from the emergency pool.
+// Blocks are carved off the pool once with a CAS on _emergencyTop and then
+// recycled through a Treiber stack per class, whose head carries a counter
+// against ABA. A heap or slab object freed in a handler is pushed to the
+// _deferredFrees of its heap instead, and the next free of that heap
+// outside a handler frees the whole list.
+//
+
+// Bytes of the pool carved into blocks
+static size_t _emergencyTop;
+
+// Free blocks of each class: the low 32 bits are the block's index, the
+// high 32 bits count the pushes and pops
+static uint64_t _emergencyFree[EMERGENCY_CLASSES];
+
+// Blocks are named by their offset in 16-byte units plus one, so 0 is none
+static inline EmergencyBlock *emergencyBlock(uint32_t index) {
+    return (EmergencyBlock *) (_emergencyPool + (size_t) (index - 1) * 16);
+}
+
+static void *emergencyMalloc(size_t size) {
+    if (size == 0 || size > ((size_t) EMERGENCY_BLOCK_MIN << (EMERGENCY_CLASSES - 1)) - sizeof(EmergencyBlock)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    unsigned c = 0;
+    while (((size_t) EMERGENCY_BLOCK_MIN << c) - sizeof(EmergencyBlock) < size)
+        c++;
+
+    uint64_t head = __atomic_load_n(&_emergencyFree[c], __ATOMIC_ACQUIRE);
+    while ((uint32_t) head != 0) {
+        EmergencyBlock *b = emergencyBlock((uint32_t) head);
+        // b may be popped and reused meanwhile; the counter fails the CAS
+        uint64_t next = ((head >> 32) + 1) << 32 | __atomic_load_n(&b->_next, __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&_emergencyFree[c], &head, next, false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_ACQUIRE))
+            return b + 1;
+    }
+
+    size_t blockSize = (size_t) EMERGENCY_BLOCK_MIN << c;
+    size_t top = __atomic_load_n(&_emergencyTop, __ATOMIC_RELAXED);
+    do {
+        if (top + blockSize > EMERGENCY_POOL_SIZE) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&_emergencyTop, &top, top + blockSize, true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    EmergencyBlock *b = (EmergencyBlock *) (_emergencyPool + top);
+    b->_class = c;
+    return b + 1;
+}
+
+static void emergencyFree(void *ptr) {
+    EmergencyBlock *b = (EmergencyBlock *) ptr - 1;
+    uint32_t index = ((char *) b - _emergencyPool) / 16 + 1;
+    uint64_t head = __atomic_load_n(&_emergencyFree[b->_class], __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&b->_next, (uint32_t) head, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&_emergencyFree[b->_class], &head, ((head >> 32) + 1) << 32 | index,
+                                          true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void deferFree(Heap *heap, void *ptr) {
+    void *head = __atomic_load_n(&heap->_deferredFrees, __ATOMIC_RELAXED);
+    do {
+        *(void **) ptr = head;
+    } while (!__atomic_compare_exchange_n(&heap->_deferredFrees, &head, ptr, true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Frees the objects that handlers queued on heap. Called outside
+ * the allocator.
+ */
+static void freeDeferred(Heap *heap) {
+    void *ptr = __atomic_exchange_n(&heap->_deferredFrees, NULL, __ATOMIC_ACQUIRE);
+    while (ptr != NULL) {
+        void *next = *(void **) ptr;
+        if (heap == &_defaultHeap)
+            free(ptr);
+        else
+            heap_free(heap, ptr);
+        ptr = next;
+    }
+}
+
+static inline bool hasDeferredFrees(Heap *heap) {
+    return __atomic_load_n(&heap->_deferredFrees, __ATOMIC_RELAXED) != NULL;
+}
+
+/**
+ * @brief Frees ptr of heap in a signal handler: a pool object at once,
+ * any other once the handler is over
+ */
+static void freeInHandler(Heap *heap, void *ptr) {
+    if (isEmergencyObject(ptr))
+        emergencyFree(ptr);
+    else
+        deferFree(heap, ptr);
+}
+
+/**
+ * @brief realloc() of a pool object, or any realloc() in a signal handler
+ * that interrupted the allocator. Outside a handler the object moves to
+ * the heap, which leaves the pool to the handlers.
+ */
+static MYMALLOC_TEXT void *reallocEmergency(void *ptr, size_t size) {
+    void *newptr = _inMalloc ? emergencyMalloc(size) : malloc(size);
+    // as in realloc(), realloc(ptr, 0) frees the old object
+    if (ptr != NULL && (newptr != NULL || size == 0)) {
+        if (newptr != NULL) {
+            size_t sizeToCopy = objectSize(ptr);
+            memcpy(newptr, ptr, sizeToCopy < size ? sizeToCopy : size);
+        }
+        free(ptr);
+    }
+    return newptr;
+}
+
+void *signal_safe_malloc(size_t size) {
+    return emergencyMalloc(size);
+}
+
+void signal_safe_free(void *ptr) {
+    if (ptr != NULL)
+        freeInHandler(&_defaultHeap, ptr);
+}
+
+//
+// C interface
+//
+
+extern MYMALLOC_TEXT void *malloc(size_t size) {
+    if (_inMalloc)
+        return emergencyMalloc(size);
+    enterAllocator();
+
+    void *ptr;
+    increaseMallocCalls();
+    if (useSlab(size)) {
+        ptr = slabMalloc(size);
+    } else {
+        pthread_mutex_lock(&_defaultHeap._mutex);
+        ptr = allocateObject(&_defaultHeap, size);
+        pthread_mutex_unlock(&_defaultHeap._mutex);
+    }
+
+    profileAllocation(ptr, size);
+    if (_traceFd >= 0)
+        traceEvent(TRACE_MALLOC, ptr, NULL, size);
+    leaveAllocator(0);
+    return ptr;
+}
+
+extern void free(void *ptr) {
+    if (ptr != 0 && (_inMalloc || isEmergencyObject(ptr))) {
+        freeInHandler(&_defaultHeap, ptr);
+        return;
+    }
+    if (hasDeferredFrees(&_defaultHeap))
+        freeDeferred(&_defaultHeap);
+
+    increaseFreeCalls();
+    if (ptr == 0) {
+        // No object to free
+        return;
+    }
+    enterAllocator();
+    if (isSlabObject(ptr)) {
+        freeSlabObject(ptr);
+        leaveAllocator(0);
+        return;
+    }
+    pthread_mutex_lock(&_defaultHeap._mutex);
+
+    FreeObject *o = (FreeObject *) ((char *) ptr - sizeof(BoundaryTag));
+    if (isSampled(&o->boundary_tag))
+        unsampleAllocation(ptr);
+    if (_traceFd >= 0)
+        traceEvent(TRACE_FREE, ptr, NULL, 0);
+
+    freeObject(&_defaultHeap, ptr);
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+    leaveAllocator(0);
+}
+
+extern MYMALLOC_TEXT void *realloc(void *ptr, size_t size) {
+    if (_inMalloc || (ptr != 0 && isEmergencyObject(ptr)))
+        return reallocEmergency(ptr, size);
+    enterAllocator();
+    if ((ptr != 0 && isSlabObject(ptr)) || useSlab(size)) {
+        void *newptr = reallocSlabObject(ptr, size);
+        leaveAllocator(0);
+        return newptr;
+    }
+
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    increaseReallocCalls();
+
+    // Allocate new object
+    void *newptr = allocateObject(&_defaultHeap, size);
+    // logged before the old object can be handed out again
+    if (_traceFd >= 0)
+        traceEvent(TRACE_REALLOC, newptr, ptr, size);
+
+    // Copy old object only if ptr != 0. On failure the old object stays
+    // valid, except for realloc(ptr, 0) which frees it.
+    if (ptr != 0 && (newptr != 0 || size == 0)) {
+
+        // copy only the minimum number of bytes
+        FreeObject *o = (FreeObject *) ((char *) ptr - sizeof(BoundaryTag));
+        size_t sizeToCopy = getSize(&o->boundary_tag) - sizeof(BoundaryTag);
+        if (sizeToCopy > size) {
+            sizeToCopy = size;
+        }
+
+        if (newptr != 0)
+            memcpy(newptr, ptr, sizeToCopy);
+
+        //Free old object
+        if (isSampled(&o->boundary_tag))
+            unsampleAllocation(ptr);
+        freeObject(&_defaultHeap, ptr);
+    }
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+
+    profileAllocation(newptr, size);
+    leaveAllocator(0);
+    return newptr;
+}
+
+extern MYMALLOC_TEXT void *calloc(size_t nelem, size_t elsize) {
+    // calloc allocates and initializes
+    size_t size = nelem * elsize;
+    if (elsize != 0 && nelem > SIZE_MAX / elsize)
+        size = SIZE_MAX;
+
+    if (_inMalloc) {
+        // pool blocks are recycled, so they need zeroing too
+        void *ptr = emergencyMalloc(size);
+        if (ptr != NULL)
+            memset(ptr, 0, size);
+        return ptr;
+    }
+    enterAllocator();
+    increaseCallocCalls();
+
+    void *ptr;
+    if (useSlab(size)) {
+        ptr = slabMalloc(size);
+    } else {
+        pthread_mutex_lock(&_defaultHeap._mutex);
+        ptr = allocateObject(&_defaultHeap, size);
+        pthread_mutex_unlock(&_defaultHeap._mutex);
+    }
+
+    profileAllocation(ptr, size);
+    if (_traceFd >= 0)
+        traceEvent(TRACE_CALLOC, ptr, NULL, size);
+
+    if (ptr) {
+        // No error
+        // Initialize chunk with 0s
+        memset(ptr, 0, size);
+    }
+
+    leaveAllocator(0);
+    return ptr;
+}
+
+extern MYMALLOC_TEXT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    // like glibc, hand out a unique minimal object for a size of 0
+    if (size == 0)
+        size = 1;
+    if (_inMalloc) {
+        // pool payloads are 16-byte aligned
+        void *ptr = alignment <= 16 ? emergencyMalloc(size) : NULL;
+        if (ptr == NULL)
+            return ENOMEM;
+        *memptr = ptr;
+        return 0;
+    }
+    enterAllocator();
+
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    increaseMallocCalls();
+
+    int savedErrno = errno;
+    void *ptr = allocateAlignedObject(&_defaultHeap, alignment, size);
+    int err = ptr == NULL ? errno : 0;
+    errno = savedErrno;
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+
+    profileAllocation(ptr, size);
+    if (_traceFd >= 0)
+        traceEvent(TRACE_MALLOC, ptr, NULL, size);
+    leaveAllocator(0);
+    if (ptr == NULL)
+        return err;
+    *memptr = ptr;
+    return 0;
+}
+
+extern MYMALLOC_TEXT void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment < sizeof(void *))
+        alignment = sizeof(void *);
+
+    void *ptr = NULL;
+    int err = posix_memalign(&ptr, alignment, size);
+    if (err != 0)
+        errno = err;
+    return ptr;
+}
+
+extern MYMALLOC_TEXT void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+MYMALLOC_TEXT size_t malloc_batch(size_t size, size_t n, void **ptrs) {
+    size_t count = 0;
+    if (_inMalloc) {
+        while (count < n && (ptrs[count] = emergencyMalloc(size)) != NULL)
+            count++;
+        return count;
+    }
+    enterAllocator();
+    __atomic_add_fetch(&_mallocCalls, n, __ATOMIC_RELAXED);
+    if (useSlab(size) && _pageFreeLists) {
+        while (count < n && (ptrs[count] = slabMalloc(size)) != NULL)
+            count++;
+    } else if (useSlab(size)) {
+        count = slabMallocBatch(size, n, ptrs);
+    } else {
+        pthread_mutex_lock(&_defaultHeap._mutex);
+        if (!_initialized)
+            initialize();
+        size_t roundedSize = roundObjectSize(size);
+        while (roundedSize != 0 && count < n) {
+            FreeObject *ptr = findFreeObject(&_defaultHeap, roundedSize);
+            if (ptr == NULL)
+                break;
+            count += carveObjects(&_defaultHeap, ptr, roundedSize, size, n - count, ptrs + count);
+        }
+        pthread_mutex_unlock(&_defaultHeap._mutex);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        profileAllocation(ptrs[i], size);
+        if (_traceFd >= 0)
+            traceEvent(TRACE_MALLOC, ptrs[i], NULL, size);
+    }
+    leaveAllocator(0);
+    return count;
+}
+
+void free_batch(void **ptrs, size_t n) {
+    if (_inMalloc) {
+        for (size_t i = 0; i < n; i++) {
+            if (ptrs[i] != 0)
+                freeInHandler(&_defaultHeap, ptrs[i]);
+        }
+        return;
+    }
+    if (hasDeferredFrees(&_defaultHeap))
+        freeDeferred(&_defaultHeap);
+    enterAllocator();
+    __atomic_add_fetch(&_freeCalls, n, __ATOMIC_RELAXED);
+
+    // slab objects go first, without the heap lock: magazines and pages
+    // may take it themselves. Runs of one class share a class lock.
+    void *run[64];
+    size_t runLength = 0;
+    unsigned runClass = 0;
+    size_t heapObjects = 0;
+    for (size_t i = 0; i < n; i++) {
+        void *ptr = ptrs[i];
+        if (ptr == 0)
+            continue;
+        if (isEmergencyObject(ptr)) {
+            emergencyFree(ptr);
+        } else if (!isSlabObject(ptr)) {
+            heapObjects++;
+        } else if (_magazines || _pageFreeLists) {
+            freeSlabObject(ptr);
+        } else {
+            unsigned c = slabOf(ptr)->_sizeClass;
+            if (runLength == sizeof(run) / sizeof(run[0]) || (runLength != 0 && c != runClass)) {
+                slabFreeBatch(runClass, run, runLength);
+                runLength = 0;
+            }
+            if (isSampledObject(ptr))
+                unsampleAllocation(ptr);
+            if (_traceFd >= 0)
+                traceEvent(TRACE_FREE, ptr, NULL, 0);
+            runClass = c;
+            run[runLength++] = ptr;
+        }
+    }
+    if (runLength != 0)
+        slabFreeBatch(runClass, run, runLength);
+    if (heapObjects == 0) {
+        leaveAllocator(0);
+        return;
+    }
+
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] == 0 || isEmergencyObject(ptrs[i]) || isSlabObject(ptrs[i]))
+            continue;
+        FreeObject *o = (FreeObject *) ((char *) ptrs[i] - sizeof(BoundaryTag));
+        if (isSampled(&o->boundary_tag))
+            unsampleAllocation(ptrs[i]);
+        if (_traceFd >= 0)
+            traceEvent(TRACE_FREE, ptrs[i], NULL, 0);
+        freeObject(&_defaultHeap, ptrs[i]);
+    }
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+    leaveAllocator(0);
+}
+
+//
+// Regions
+//
+// A region bump-allocates from chunks that are ordinary heap blocks, so
+// dropping a region costs one freeObject() per chunk no matter how many
+// objects were allocated in it, and the chunks coalesce back into the heap.
+// In a signal handler that interrupted the allocator a region cannot grow,
+// and the chunks it drops are freed once the handler is over.
+//
+
+#define REGION_CHUNK_SIZE 65536
+
+/**
+ * @brief Takes a chunk with room for at least size bytes from the heap and
+ * makes it the region's current chunk
+ */
+static bool growRegion(Region *region, size_t size) {
+    size_t chunkSize = REGION_CHUNK_SIZE - sizeof(BoundaryTag);
+    if (size + sizeof(RegionChunk) > chunkSize)
+        chunkSize = size + sizeof(RegionChunk);
+
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    RegionChunk *chunk = allocateObject(&_defaultHeap, chunkSize);
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+    if (chunk == NULL)
+        return false;
+
+    chunk->_next = region->_chunks;
+    chunk->_size = chunkSize - sizeof(RegionChunk);
+    region->_chunks = chunk;
+    region->_cur = (char *) (chunk + 1);
+    region->_end = region->_cur + chunk->_size;
+    return true;
+}
+
+Region *region_create() {
+    if (_inMalloc) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    enterAllocator();
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    Region *region = allocateObject(&_defaultHeap, sizeof(Region));
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+    leaveAllocator(0);
+    if (region == NULL)
+        return NULL;
+
+    region->_chunks = NULL;
+    region->_cur = NULL;
+    region->_end = NULL;
+    return region;
+}
+
+void *region_alloc(Region *region, size_t size) {
+    size = (size + 7) & ~(size_t) 7;
+    if (size == 0 || size >= ARENA_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ((size_t) (region->_end - region->_cur) < size) {
+        if (_inMalloc) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        enterAllocator();
+        bool grown = growRegion(region, size);
+        leaveAllocator(0);
+        if (!grown)
+            return NULL;
+    }
+
+    void *ptr = region->_cur;
+    region->_cur += size;
+    return ptr;
+}
+
+/**
+ * @brief Gives the chunks starting at chunk back to the heap
+ */
+static void freeRegionChunks(RegionChunk *chunk) {
+    if (_inMalloc) {
+        while (chunk != NULL) {
+            RegionChunk *next = chunk->_next;
+            deferFree(&_defaultHeap, chunk);
+            chunk = next;
+        }
+        return;
+    }
+    enterAllocator();
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    while (chunk != NULL) {
+        RegionChunk *next = chunk->_next;
+        freeObject(&_defaultHeap, chunk);
+        chunk = next;
+    }
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+    leaveAllocator(0);
+}
+
+void region_reset(Region *region) {
+    if (region->_chunks == NULL)
+        return;
+
+    // keep the newest standard-sized chunk so the next round does not go
+    // to the heap again; an oversized one-off would pin its memory
+    size_t standardSize = REGION_CHUNK_SIZE - sizeof(BoundaryTag) - sizeof(RegionChunk);
+    RegionChunk **link = &region->_chunks;
+    while (*link != NULL && (*link)->_size != standardSize)
+        link = &(*link)->_next;
+    RegionChunk *keep = *link;
+    if (keep != NULL)
+        *link = keep->_next;
+    freeRegionChunks(region->_chunks);
+
+    region->_chunks = keep;
+    if (keep == NULL) {
+        region->_cur = region->_end = NULL;
+        return;
+    }
+    keep->_next = NULL;
+    region->_cur = (char *) (keep + 1);
+    region->_end = region->_cur + keep->_size;
+}
+
+void region_destroy(Region *region) {
+    freeRegionChunks(region->_chunks);
+    if (_inMalloc) {
+        deferFree(&_defaultHeap, region);
+        return;
+    }
+    enterAllocator();
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    freeObject(&_defaultHeap, region);
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+    leaveAllocator(0);
+}
+
+//
+// Named heaps
+//
+// A named heap has its own lock, free list, chunks and accounting, so its
+// churn never fragments the default heap or other named heaps. Its chunks
+// are mapped rather than taken from sbrk(), which lets heap_destroy()
+// unmap them all without walking any objects. In a signal handler that
+// interrupted the allocator, heap_malloc is served from the emergency pool
+// and heap_free queues the object on its heap.
+//
+
+// Named heaps by their MALLOCX_HEAP index; a slot is claimed with a CAS
+static Heap *_heapTable[MALLOCX_HEAPS];
+
+Heap *heap_create(const char *name) {
+    if (_inMalloc) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    enterAllocator();
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    Heap *heap = allocateObject(&_defaultHeap, sizeof(Heap));
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+    leaveAllocator(0);
+    if (heap == NULL)
+        return NULL;
+
+    memset(heap, 0, sizeof(Heap));
+    pthread_mutex_init(&heap->_mutex, NULL);
+    heap->_freeList = &heap->_freeListSentinel;
+    heap->_freeList->free_list_node._next = heap->_freeList;
+    heap->_freeList->free_list_node._prev = heap->_freeList;
+    if (name != NULL)
+        strncpy(heap->_name, name, sizeof(heap->_name) - 1);
 
-        //Free old object
-        freeObject(ptr);
+    heap->_index = -1;
+    for (int i = 0; i < MALLOCX_HEAPS; i++) {
+        Heap *expected = NULL;
+        if (__atomic_compare_exchange_n(&_heapTable[i], &expected, heap, false, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+            heap->_index = i;
+            break;
+        }
     }
+    return heap;
+}
 
-    return newptr;
+int heap_index(Heap *heap) {
+    if (heap == NULL || heap == &_defaultHeap)
+        return -1;
+    return heap->_index;
 }
 
-extern void *calloc(size_t nelem, size_t elsize) {
-    pthread_mutex_lock(&mutex);
-    increaseCallocCalls();
+MYMALLOC_TEXT void *heap_malloc(Heap *heap, size_t size) {
+    if (_inMalloc)
+        return emergencyMalloc(size);
+    enterAllocator();
+    pthread_mutex_lock(&heap->_mutex);
+    void *ptr = allocateObject(heap, size);
+    pthread_mutex_unlock(&heap->_mutex);
 
-    // calloc allocates and initializes
-    size_t size = nelem * elsize;
+    profileAllocation(ptr, size);
+    if (_traceFd >= 0)
+        traceEvent(TRACE_MALLOC, ptr, NULL, size);
+    leaveAllocator(0);
+    return ptr;
+}
 
-    void *ptr = allocateObject(size);
+MYMALLOC_TEXT void *heap_memalign(Heap *heap, size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (_inMalloc) {
+        // pool payloads are 16-byte aligned
+        if (alignment <= 16)
+            return emergencyMalloc(size);
+        errno = ENOMEM;
+        return NULL;
+    }
 
-    if (ptr) {
-        // No error
-        // Initialize chunk with 0s
+    enterAllocator();
+    pthread_mutex_lock(&heap->_mutex);
+    void *ptr = allocateAlignedObject(heap, alignment, size);
+    pthread_mutex_unlock(&heap->_mutex);
+
+    profileAllocation(ptr, size);
+    if (_traceFd >= 0)
+        traceEvent(TRACE_MALLOC, ptr, NULL, size);
+    leaveAllocator(0);
+    return ptr;
+}
+
+void heap_free(Heap *heap, void *ptr) {
+    if (ptr == 0)
+        return;
+    if (_inMalloc || isEmergencyObject(ptr)) {
+        freeInHandler(heap, ptr);
+        return;
+    }
+    if (hasDeferredFrees(heap))
+        freeDeferred(heap);
+
+    enterAllocator();
+    FreeObject *o = (FreeObject *) ((char *) ptr - sizeof(BoundaryTag));
+    if (isSampled(&o->boundary_tag))
+        unsampleAllocation(ptr);
+    if (_traceFd >= 0)
+        traceEvent(TRACE_FREE, ptr, NULL, 0);
+
+    pthread_mutex_lock(&heap->_mutex);
+    freeObject(heap, ptr);
+    pthread_mutex_unlock(&heap->_mutex);
+    leaveAllocator(0);
+}
+
+/**
+ * @brief Drops the samples of the objects still live in heap, whose chunks
+ * are about to be unmapped
+ */
+static void unsampleHeap(Heap *heap) {
+    pthread_mutex_lock(&_profMutex);
+    for (size_t i = 0; _profLiveSamples != 0 && i < PROF_SAMPLES; i++) {
+        // removing a sample may shift another one into slot i
+        while (_profSamples[i]._ptr != NULL) {
+            char *ptr = _profSamples[i]._ptr;
+            HeapChunk *chunk = heap->_chunks;
+            while (chunk != NULL && (size_t) (ptr - (char *) chunk) >= chunk->_size)
+                chunk = chunk->_next;
+            if (chunk == NULL)
+                break;
+            removeSample(i);
+        }
+    }
+    pthread_mutex_unlock(&_profMutex);
+}
+
+void heap_destroy(Heap *heap) {
+    // objects queued by handlers go with the chunks
+    sig_atomic_t outer = enterAllocator();
+    if (heap->_index >= 0)
+        __atomic_store_n(&_heapTable[heap->_index], NULL, __ATOMIC_RELEASE);
+    if (_profSamples != NULL)
+        unsampleHeap(heap);
+
+    HeapChunk *chunk = heap->_chunks;
+    while (chunk != NULL) {
+        HeapChunk *next = chunk->_next;
+        releaseChunk(chunk, chunk->_size, true);
+        chunk = next;
+    }
+    pthread_mutex_destroy(&heap->_mutex);
+
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    freeObject(&_defaultHeap, heap);
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+    leaveAllocator(outer);
+}
+
+//
+// Extended API
+//
+// mallocx() and the functions around it take the alignment, zeroing, heap
+// and cache choices as flags. An object of the default heap comes from the
+// slabs whenever malloc() would take it from there and its alignment
+// allows it, so the other functions tell slab and heap objects apart by
+// address, as free() does. In a signal handler that interrupted the
+// allocator they fall back on the emergency pool like malloc(), and an
+// object cannot be resized in place.
+//
+
+/**
+ * @return the heap selected by flags, or NULL if its index is not in use
+ */
+static Heap *flagsHeap(int flags) {
+    unsigned index = ((unsigned) flags >> 8) & 0xfff;
+    if (index == 0)
+        return &_defaultHeap;
+    if (index > MALLOCX_HEAPS)
+        return NULL;
+    return __atomic_load_n(&_heapTable[index - 1], __ATOMIC_ACQUIRE);
+}
+
+static inline size_t flagsAlignment(int flags) {
+    size_t alignment = (size_t) 1 << (flags & 0x3f);
+    if ((flags & MALLOCX_CACHE_LINE) && alignment < CACHE_LINE)
+        alignment = CACHE_LINE;
+    return alignment;
+}
+
+/**
+ * @return size, padded to whole cache lines for MALLOCX_CACHE_LINE
+ */
+static inline size_t flagsSize(size_t size, int flags) {
+    if ((flags & MALLOCX_CACHE_LINE) && size <= SIZE_MAX - CACHE_LINE)
+        size = (size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+    return size;
+}
+
+/**
+ * @brief Initializes the allocator before the first size decision, which
+ * depends on whether slabs are on
+ */
+static void initializeDefaultHeap() {
+    pthread_mutex_lock(&_defaultHeap._mutex);
+    if (!_initialized)
+        initialize();
+    pthread_mutex_unlock(&_defaultHeap._mutex);
+}
+
+/**
+ * @return true if a request of size bytes with flags is served by the slabs:
+ * slab objects are aligned to the largest power of two that divides their
+ * class size. Without the thread cache, page free lists leave the request
+ * to the heap.
+ */
+static bool useSlabFlags(Heap *heap, size_t size, int flags) {
+    return heap == &_defaultHeap && useSlab(size) &&
+           (_classSize[slabClass(size)] & (flagsAlignment(flags) - 1)) == 0 &&
+           !((flags & MALLOCX_TCACHE_NONE) && _pageFreeLists);
+}
+
+static void *allocateFlags(Heap *heap, size_t size, int flags) {
+    if (useSlabFlags(heap, size, flags)) {
+        if (flags & MALLOCX_TCACHE_NONE)
+            return slabClassMalloc(slabClass(size));
+        return slabMalloc(size);
+    }
+    pthread_mutex_lock(&heap->_mutex);
+    void *ptr = allocateAlignedObject(heap, flagsAlignment(flags), size);
+    pthread_mutex_unlock(&heap->_mutex);
+    return ptr;
+}
+
+/**
+ * @brief mallocx() in a signal handler that interrupted the allocator
+ */
+static void *emergencyMallocx(size_t size, int flags) {
+    size = flagsSize(size, flags);
+    // pool payloads are 16-byte aligned
+    if (flagsAlignment(flags) > 16) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *ptr = emergencyMalloc(size);
+    if (ptr != NULL && (flags & MALLOCX_ZERO))
         memset(ptr, 0, size);
+    return ptr;
+}
+
+/**
+ * @brief rallocx() of a pool object, or any rallocx() in a signal handler
+ * that interrupted the allocator. As in reallocEmergency(), outside a
+ * handler the object moves to its heap.
+ */
+static MYMALLOC_TEXT void *rallocxEmergency(Heap *heap, void *ptr, size_t size, int flags) {
+    void *newptr = _inMalloc ? emergencyMallocx(size, flags) : mallocx(size, flags);
+    if (newptr == NULL)
+        return NULL;
+    size_t oldSize = objectSize(ptr);
+    size = flagsSize(size, flags);
+    memcpy(newptr, ptr, oldSize < size ? oldSize : size);
+    freeInHandler(isSlabObject(ptr) ? &_defaultHeap : heap, ptr);
+    return newptr;
+}
+
+static void releaseFlags(Heap *heap, void *ptr, int flags) {
+    if (isEmergencyObject(ptr)) {
+        emergencyFree(ptr);
+        return;
+    }
+    if (isSlabObject(ptr)) {
+        if (isSampledObject(ptr))
+            unsampleAllocation(ptr);
+        if ((flags & MALLOCX_TCACHE_NONE) && !_pageFreeLists)
+            slabFreeBatch(slabOf(ptr)->_sizeClass, &ptr, 1);
+        else
+            slabFree(ptr);
+        return;
+    }
+    FreeObject *o = (FreeObject *) ((char *) ptr - sizeof(BoundaryTag));
+    if (isSampled(&o->boundary_tag))
+        unsampleAllocation(ptr);
+    pthread_mutex_lock(&heap->_mutex);
+    freeObject(heap, ptr);
+    pthread_mutex_unlock(&heap->_mutex);
+}
+
+MYMALLOC_TEXT void *mallocx(size_t size, int flags) {
+    Heap *heap = flagsHeap(flags);
+    if (heap == NULL) {
+        errno = EINVAL;
+        return NULL;
     }
+    if (_inMalloc)
+        return emergencyMallocx(size, flags);
+    enterAllocator();
+    increaseMallocCalls();
+    size = flagsSize(size, flags);
+    if (!_initialized)
+        initializeDefaultHeap();
 
+    void *ptr = allocateFlags(heap, size, flags);
+    profileAllocation(ptr, size);
+    if (_traceFd >= 0)
+        traceEvent(TRACE_MALLOC, ptr, NULL, size);
+    if (ptr != NULL && (flags & MALLOCX_ZERO))
+        memset(ptr, 0, size);
+    leaveAllocator(0);
     return ptr;
 }
 
+MYMALLOC_TEXT void *rallocx(void *ptr, size_t size, int flags) {
+    if (ptr == NULL)
+        return mallocx(size, flags);
+    Heap *heap = flagsHeap(flags);
+    if (heap == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (_inMalloc || isEmergencyObject(ptr))
+        return rallocxEmergency(heap, ptr, size, flags);
+    enterAllocator();
+    increaseReallocCalls();
+    size = flagsSize(size, flags);
+
+    // in place if ptr has the alignment and room for size bytes
+    size_t oldSize = objectSize(ptr);
+    size_t usable = 0;
+    if (((uintptr_t) ptr & (flagsAlignment(flags) - 1)) == 0) {
+        if (isSlabObject(ptr)) {
+            if (useSlab(size) && slabClass(size) == slabOf(ptr)->_sizeClass)
+                usable = oldSize;
+        } else {
+            pthread_mutex_lock(&heap->_mutex);
+            usable = resizeObject(heap, ptr, size);
+            pthread_mutex_unlock(&heap->_mutex);
+        }
+    }
+    if (usable >= size) {
+        if ((flags & MALLOCX_ZERO) && usable > oldSize)
+            memset((char *) ptr + oldSize, 0, usable - oldSize);
+        if (isSampledObject(ptr))
+            resizeSample(ptr, size);
+        if (_traceFd >= 0)
+            traceEvent(TRACE_REALLOC, ptr, ptr, size);
+        leaveAllocator(0);
+        return ptr;
+    }
+
+    void *newptr = allocateFlags(heap, size, flags);
+    if (newptr == NULL) {
+        leaveAllocator(0);
+        return NULL;
+    }
+    memcpy(newptr, ptr, oldSize < size ? oldSize : size);
+    if ((flags & MALLOCX_ZERO) && size > oldSize)
+        memset((char *) newptr + oldSize, 0, size - oldSize);
+    // logged before the old object can be handed out again
+    if (_traceFd >= 0)
+        traceEvent(TRACE_REALLOC, newptr, ptr, size);
+    releaseFlags(heap, ptr, flags);
+
+    profileAllocation(newptr, size);
+    leaveAllocator(0);
+    return newptr;
+}
+
+size_t xallocx(void *ptr, size_t size, size_t extra, int flags) {
+    size_t oldSize = objectSize(ptr);
+    if (_inMalloc || isEmergencyObject(ptr))
+        return oldSize;
+    enterAllocator();
+    increaseReallocCalls();
+    size_t usable = oldSize;
+    Heap *heap = flagsHeap(flags);
+    // a slab object never leaves its class
+    if (!isSlabObject(ptr) && heap != NULL) {
+        size_t target = flagsSize(size + extra < size ? SIZE_MAX : size + extra, flags);
+        size = flagsSize(size, flags);
+        pthread_mutex_lock(&heap->_mutex);
+        usable = resizeObject(heap, ptr, target);
+        if (usable < size)
+            usable = resizeObject(heap, ptr, size);
+        pthread_mutex_unlock(&heap->_mutex);
+        if (usable >= size && isSampledObject(ptr))
+            resizeSample(ptr, usable >= target ? target : size);
+    }
+
+    if ((flags & MALLOCX_ZERO) && usable > oldSize)
+        memset((char *) ptr + oldSize, 0, usable - oldSize);
+    if (_traceFd >= 0)
+        traceEvent(TRACE_REALLOC, ptr, ptr, size);
+    leaveAllocator(0);
+    return usable;
+}
+
+size_t sallocx(const void *ptr, int flags) {
+    return objectSize((void *) ptr);
+}
+
+size_t nallocx(size_t size, int flags) {
+    size = flagsSize(size, flags);
+    Heap *heap = flagsHeap(flags);
+    if (heap == NULL)
+        return 0;
+    if (!_initialized) {
+        if (_inMalloc)
+            return 0;
+        enterAllocator();
+        initializeDefaultHeap();
+        leaveAllocator(0);
+    }
+    if (useSlabFlags(heap, size, flags))
+        return _classSize[slabClass(size)];
+
+    int savedErrno = errno;
+    size_t roundedSize = roundObjectSize(size);
+    errno = savedErrno;
+    size_t alignment = flagsAlignment(flags);
+    if (roundedSize == 0 || (alignment > 8 && (alignment >= ARENA_SIZE ||
+        roundedSize + alignment + MIN_OBJECT_SIZE > ARENA_SIZE - 2 * sizeof(BoundaryTag))))
+        return 0;
+    // carveObject() may hand out a few bytes more when the rest of the
+    // free block is too small to split
+    return roundedSize - sizeof(BoundaryTag);
+}
+
+void dallocx(void *ptr, int flags) {
+    Heap *heap = ptr != NULL && isSlabObject(ptr) ? &_defaultHeap : flagsHeap(flags);
+    if (ptr != NULL && (_inMalloc || isEmergencyObject(ptr))) {
+        if (heap != NULL || isEmergencyObject(ptr))
+            freeInHandler(heap, ptr);
+        return;
+    }
+    increaseFreeCalls();
+    if (ptr == NULL || heap == NULL)
+        return;
+    if (hasDeferredFrees(heap))
+        freeDeferred(heap);
+    enterAllocator();
+    if (_traceFd >= 0)
+        traceEvent(TRACE_FREE, ptr, NULL, 0);
+    releaseFlags(heap, ptr, flags);
+    leaveAllocator(0);
+}
+
+//
+// Shared heaps
+//
+// A shared heap is one fixed-size chunk at the start of a file that every
+// process maps with MAP_SHARED. The blocks use the same boundary tags,
+// placement and coalescing as the private heaps; only the free list links
+// are offsets. The lock is a robust process-shared mutex. _busy tells a
+// process that inherits the lock from a dead owner whether the owner was
+// in the middle of an update, in which case the mutex is left unrecoverable
+// instead of being handed on with a broken free list.
+//
+
+#define SHARED_HEAP_MAGIC 0x3250454844524853UL     // "SHRDHEP2"
+
+// Offset of the first block, right after the header and the head fence post
+#define SHARED_HEAP_FIRST_OFFSET (((sizeof(SharedHeap) + 7) & ~7UL) + sizeof(SharedBoundaryTag))
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+static SharedFreeObject *sharedObject(SharedHeap *heap, size_t offset) {
+    return (SharedFreeObject *) ((char *) heap + offset);
+}
+
+static size_t sharedOffset(SharedHeap *heap, void *o) {
+    return (char *) o - (char *) heap;
+}
+
+static void insertSharedObject(SharedHeap *heap, SharedFreeObject *o) {
+    SharedFreeObject *freeList = &heap->_freeListSentinel;
+    o->_nextOffset = freeList->_nextOffset;
+    o->_prevOffset = sharedOffset(heap, freeList);
+    sharedObject(heap, freeList->_nextOffset)->_prevOffset = sharedOffset(heap, o);
+    freeList->_nextOffset = sharedOffset(heap, o);
+}
+
+static void removeSharedObject(SharedHeap *heap, SharedFreeObject *o) {
+    sharedObject(heap, o->_prevOffset)->_nextOffset = o->_nextOffset;
+    sharedObject(heap, o->_nextOffset)->_prevOffset = o->_prevOffset;
+}
+
+static void replaceSharedObject(SharedHeap *heap, SharedFreeObject *old, SharedFreeObject *o) {
+    o->_nextOffset = old->_nextOffset;
+    o->_prevOffset = old->_prevOffset;
+    sharedObject(heap, o->_prevOffset)->_nextOffset = sharedOffset(heap, o);
+    sharedObject(heap, o->_nextOffset)->_prevOffset = sharedOffset(heap, o);
+}
+
+// a left size of 0 means the head fence post is on the left
+#define isSharedLeftFree(tag) \
+  ((tag)->_leftObjectSize != 0 && !isAllocated((SharedBoundaryTag *) ((char *) (tag) - (tag)->_leftObjectSize)))
+#define getSharedLeftSize(tag) ((tag)->_leftObjectSize)
+
+static inline void setSharedLeftTag(SharedBoundaryTag *tag, size_t leftSize, bool leftFree) {
+    tag->_leftObjectSize = leftSize;
+}
+
+DEFINE_BLOCK_FUNCTIONS(shared, SharedHeap, SharedFreeObject, SharedBoundaryTag, sizeof(SharedFreeObject),
+                       insertSharedObject, removeSharedObject, replaceSharedObject, isSharedLeftFree,
+                       getSharedLeftSize, setSharedLeftTag)
+
+/**
+ * @brief Returns the object o to the heap. Called with the heap locked.
+ */
+static void freeSharedObject(SharedHeap *heap, SharedFreeObject *o) {
+    size_t currSize = getSize(&o->boundary_tag);
+    heap->_freeBytes += currSize;
+    heap->_allocatedBytes -= currSize;
+    heap->_requestedBytes -= currSize - sizeof(SharedBoundaryTag) - getPadding(&o->boundary_tag);
+    sharedMergeBlock(heap, o);
+}
+
+/**
+ * @brief Queues ptr, which a signal handler frees while the heap is locked.
+ * The next word of the queue lives in the object, as an offset.
+ */
+static void deferSharedFree(SharedHeap *heap, void *ptr) {
+    size_t offset = sharedOffset(heap, ptr);
+    size_t head = __atomic_load_n(&heap->_deferredFrees, __ATOMIC_RELAXED);
+    do {
+        *(size_t *) ptr = head;
+    } while (!__atomic_compare_exchange_n(&heap->_deferredFrees, &head, offset, true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Frees the objects handlers queued on the heap. Called with the
+ * heap locked and marked busy.
+ */
+static void freeDeferredShared(SharedHeap *heap) {
+    size_t offset = __atomic_exchange_n(&heap->_deferredFrees, 0, __ATOMIC_ACQUIRE);
+    while (offset != 0) {
+        size_t next = *(size_t *) ((char *) heap + offset);
+        freeSharedObject(heap, sharedObject(heap, offset - sizeof(SharedBoundaryTag)));
+        offset = next;
+    }
+}
+
+/**
+ * @brief Locks the heap, marks it busy and frees the objects handlers
+ * queued on it. With wait false (in a handler that interrupted the
+ * allocator, which may hold this very lock) a locked heap is not waited
+ * for.
+ *
+ * @return 0, EDEADLK if wait is false and the heap is locked, or an error
+ * number if the heap can not be used any more
+ */
+static int lockSharedHeap(SharedHeap *heap, bool wait) {
+    int rc = wait ? pthread_mutex_lock(&heap->_mutex) : pthread_mutex_trylock(&heap->_mutex);
+    if (rc == EBUSY)
+        return EDEADLK;
+    if (rc == EOWNERDEAD) {
+        if (heap->_busy) {
+            // unlocking without pthread_mutex_consistent() makes every
+            // later lock fail with ENOTRECOVERABLE
+            pthread_mutex_unlock(&heap->_mutex);
+            return ENOTRECOVERABLE;
+        }
+        pthread_mutex_consistent(&heap->_mutex);
+        rc = 0;
+    }
+    if (rc == 0) {
+        heap->_busy = 1;
+        if (__atomic_load_n(&heap->_deferredFrees, __ATOMIC_RELAXED) != 0)
+            freeDeferredShared(heap);
+    }
+    return rc;
+}
+
+static void unlockSharedHeap(SharedHeap *heap) {
+    heap->_busy = 0;
+    pthread_mutex_unlock(&heap->_mutex);
+}
+
+static int initSharedHeapMutex(SharedHeap *heap) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(&heap->_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    heap->_busy = 0;
+    return rc;
+}
+
+/**
+ * @brief Lays out an empty heap in a freshly created mapping
+ */
+static int initSharedHeap(SharedHeap *heap, size_t size) {
+    int rc = initSharedHeapMutex(heap);
+    if (rc != 0)
+        return rc;
+
+    heap->_size = size;
+    heap->_base = heap;
+    heap->_freeListSentinel._nextOffset = sharedOffset(heap, &heap->_freeListSentinel);
+    heap->_freeListSentinel._prevOffset = sharedOffset(heap, &heap->_freeListSentinel);
+
+    // establish fence posts around the rest of the file
+    char *mem = (char *) heap + SHARED_HEAP_FIRST_OFFSET - sizeof(SharedBoundaryTag);
+    SharedBoundaryTag *fencePostHead = (SharedBoundaryTag *) mem;
+    setAllocated(fencePostHead, ALLOCATED);
+    setSize(fencePostHead, 0);
+
+    SharedBoundaryTag *fencePostFoot = (SharedBoundaryTag *) ((char *) heap + size - sizeof(SharedBoundaryTag));
+    setAllocated(fencePostFoot, ALLOCATED);
+    setSize(fencePostFoot, 0);
+
+    SharedFreeObject *chunk = (SharedFreeObject *) (mem + sizeof(SharedBoundaryTag));
+    chunk->boundary_tag._objectSizeAndAlloc = (char *) fencePostFoot - (char *) chunk;
+    chunk->boundary_tag._leftObjectSize = 0;
+    fencePostFoot->_leftObjectSize = getSize(&chunk->boundary_tag);
+    heap->_freeBytes = getSize(&chunk->boundary_tag);
+    insertSharedObject(heap, chunk);
+
+    // publish the heap only once it is complete
+    __atomic_store_n(&heap->_magic, SHARED_HEAP_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Walks every block and the free list of a heap that was not closed
+ * cleanly, and recomputes its accounting
+ *
+ * @return true if the boundary tags and the free list are consistent
+ */
+static bool checkSharedHeap(SharedHeap *heap) {
+    char *first = (char *) heap + SHARED_HEAP_FIRST_OFFSET;
+    char *end = (char *) heap + heap->_size - sizeof(SharedBoundaryTag);
+    size_t freeBytes = 0, allocatedBytes = 0, requestedBytes = 0, freeBlocks = 0;
+    size_t leftSize = 0;
+    bool leftFree = false;
+
+    char *p = first;
+    while (p < end) {
+        SharedBoundaryTag *tag = (SharedBoundaryTag *) p;
+        size_t size = getSize(tag);
+        if (size < sizeof(SharedFreeObject) || size > (size_t) (end - p) || tag->_leftObjectSize != leftSize)
+            return false;
+        if (isAllocated(tag)) {
+            if (getPadding(tag) > size - sizeof(SharedBoundaryTag))
+                return false;
+            allocatedBytes += size;
+            requestedBytes += size - sizeof(SharedBoundaryTag) - getPadding(tag);
+            leftFree = false;
+        } else {
+            // adjacent free blocks are always coalesced
+            if (leftFree)
+                return false;
+            freeBytes += size;
+            freeBlocks++;
+            leftFree = true;
+        }
+        leftSize = size;
+        p += size;
+    }
+    SharedBoundaryTag *fencePostFoot = (SharedBoundaryTag *) end;
+    if (p != end || !isAllocated(fencePostFoot) || getSize(fencePostFoot) != 0 ||
+        fencePostFoot->_leftObjectSize != leftSize)
+        return false;
+
+    // every free block must be in the list exactly once
+    size_t prev = sharedOffset(heap, &heap->_freeListSentinel);
+    size_t offset = heap->_freeListSentinel._nextOffset;
+    for (size_t n = 0; offset != sharedOffset(heap, &heap->_freeListSentinel); n++) {
+        if (n == freeBlocks || offset < SHARED_HEAP_FIRST_OFFSET || offset > (size_t) (end - (char *) heap) ||
+            (offset & 7) != 0)
+            return false;
+        SharedFreeObject *o = sharedObject(heap, offset);
+        if (isAllocated(&o->boundary_tag) || o->_prevOffset != prev)
+            return false;
+        prev = offset;
+        offset = o->_nextOffset;
+    }
+    if (heap->_freeListSentinel._prevOffset != prev)
+        return false;
+
+    // objects queued by handlers are allocated blocks inside the heap
+    offset = heap->_deferredFrees;
+    for (size_t n = 0; offset != 0; n++) {
+        if (n == allocatedBytes / sizeof(SharedFreeObject) ||
+            offset < SHARED_HEAP_FIRST_OFFSET + sizeof(SharedBoundaryTag) ||
+            offset >= (size_t) (end - (char *) heap) || (offset & 7) != 0 ||
+            !isAllocated(&sharedObject(heap, offset - sizeof(SharedBoundaryTag))->boundary_tag))
+            return false;
+        offset = *(size_t *) ((char *) heap + offset);
+    }
+
+    heap->_freeBytes = freeBytes;
+    heap->_allocatedBytes = allocatedBytes;
+    heap->_requestedBytes = requestedBytes;
+    return true;
+}
+
+/**
+ * @brief Makes a persistent heap mapped by a new process usable again
+ */
+static int restorePersistentHeap(SharedHeap *heap) {
+    // the mutex may have been held when the last owner went away
+    int rc = initSharedHeapMutex(heap);
+    if (rc != 0)
+        return rc;
+    if (!heap->_clean && !checkSharedHeap(heap))
+        return EINVAL;
+    heap->_clean = 0;
+    return 0;
+}
+
+/**
+ * @brief Maps the heap in path, creating it if the file is empty.
+ *
+ * A persistent heap is mapped at the address it was created at, so that
+ * pointers stored in it stay valid, and its file stays locked for as long
+ * as it is mapped so no other process can open it.
+ */
+static SharedHeap *openSharedHeap(const char *path, size_t size, void *addr, bool persistent) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return NULL;
+
+    // the file lock keeps other processes from looking at the heap while
+    // it is created. It is never waited for: a process that opens the heap
+    // at the same time fails with EBUSY and can retry.
+    struct stat st;
+    SharedHeap *heap = MAP_FAILED;
+    int err = 0;
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        err = errno == EWOULDBLOCK ? EBUSY : errno;
+        goto out;
+    }
+    if (fstat(fd, &st) < 0) {
+        err = errno;
+        goto out;
+    }
+
+    bool create = st.st_size == 0;
+    int flags = addr != NULL ? MAP_SHARED | MAP_FIXED_NOREPLACE : MAP_SHARED;
+    if (create) {
+        // block sizes have 56 bits (the top byte holds the padding)
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        if (size < SHARED_HEAP_FIRST_OFFSET + sizeof(SharedFreeObject) + sizeof(SharedBoundaryTag) ||
+            size >= (1UL << 56)) {
+            err = EINVAL;
+            goto out;
+        }
+        size = (size + pageSize - 1) & ~(pageSize - 1);
+        if (ftruncate(fd, size) < 0) {
+            err = errno;
+            goto out;
+        }
+    } else {
+        size = st.st_size;
+        addr = NULL;
+        flags = MAP_SHARED;
+        if (persistent) {
+            SharedHeap header;
+            if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header._magic != SHARED_HEAP_MAGIC) {
+                err = EINVAL;
+                goto out;
+            }
+            addr = header._base;
+            flags |= MAP_FIXED_NOREPLACE;
+        }
+    }
+
+    heap = mmap(addr, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (heap == MAP_FAILED) {
+        err = errno;
+        goto out;
+    }
+    if (addr != NULL && heap != addr) {
+        // kernels without MAP_FIXED_NOREPLACE take the address as a hint
+        err = EEXIST;
+    } else if (create) {
+        err = initSharedHeap(heap, size);
+    } else if (size < sizeof(SharedHeap) ||
+               __atomic_load_n(&heap->_magic, __ATOMIC_ACQUIRE) != SHARED_HEAP_MAGIC ||
+               heap->_size != size || (persistent && heap->_base != heap)) {
+        err = EINVAL;
+    } else if (persistent) {
+        err = restorePersistentHeap(heap);
+    }
+    if (err != 0) {
+        munmap(heap, size);
+        heap = MAP_FAILED;
+    }
+
+out:
+    // the mapping keeps the open file alive, so close() alone would not
+    // drop the file lock. A persistent heap keeps it until it is unmapped.
+    if (!persistent || heap == MAP_FAILED)
+        flock(fd, LOCK_UN);
+    close(fd);
+    if (heap == MAP_FAILED) {
+        errno = err;
+        return NULL;
+    }
+    return heap;
+}
+
+SharedHeap *shared_heap_open(const char *path, size_t size) {
+    return openSharedHeap(path, size, NULL, false);
+}
+
+SharedHeap *persistent_heap_open(const char *path, size_t size, void *addr) {
+    return openSharedHeap(path, size, addr, true);
+}
+
+void *shared_heap_malloc(SharedHeap *heap, size_t size) {
+    if (size == 0 || size > heap->_size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t roundedSize = (size + sizeof(SharedBoundaryTag) + 7) & ~7;
+    if (roundedSize < sizeof(SharedFreeObject))
+        roundedSize = sizeof(SharedFreeObject);
+
+    sig_atomic_t outer = enterAllocator();
+    int rc = lockSharedHeap(heap, !outer);
+    if (rc != 0) {
+        leaveAllocator(outer);
+        errno = rc;
+        return NULL;
+    }
+
+    // first fit, carving from the end of the block like carveObject()
+    SharedFreeObject *freeList = &heap->_freeListSentinel;
+    SharedFreeObject *ptr = sharedObject(heap, freeList->_nextOffset);
+    while (ptr != freeList && getSize(&ptr->boundary_tag) < roundedSize)
+        ptr = sharedObject(heap, ptr->_nextOffset);
+    if (ptr == freeList) {
+        unlockSharedHeap(heap);
+        leaveAllocator(outer);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    SharedFreeObject *f = sharedSplitBlock(heap, ptr, &roundedSize, false);
+    setPadding(&f->boundary_tag, roundedSize - sizeof(SharedBoundaryTag) - size);
+
+    heap->_freeBytes -= roundedSize;
+    heap->_allocatedBytes += roundedSize;
+    heap->_requestedBytes += size;
+    unlockSharedHeap(heap);
+    leaveAllocator(outer);
+
+    return (char *) f + sizeof(SharedBoundaryTag);
+}
+
+void shared_heap_free(SharedHeap *heap, void *ptr) {
+    if (ptr == 0)
+        return;
+    sig_atomic_t outer = enterAllocator();
+    int rc = lockSharedHeap(heap, !outer);
+    if (rc == EDEADLK)
+        deferSharedFree(heap, ptr);
+    if (rc != 0) {
+        leaveAllocator(outer);
+        return;
+    }
+
+    freeSharedObject(heap, (SharedFreeObject *) ((char *) ptr - sizeof(SharedBoundaryTag)));
+    unlockSharedHeap(heap);
+    leaveAllocator(outer);
+}
+
+void shared_heap_close(SharedHeap *heap) {
+    munmap(heap, heap->_size);
+}
+
+void persistent_heap_close(SharedHeap *heap) {
+    sig_atomic_t outer = enterAllocator();
+    if (lockSharedHeap(heap, true) == 0) {
+        heap->_clean = 1;
+        unlockSharedHeap(heap);
+    }
+    leaveAllocator(outer);
+    // unmapping drops the last reference to the file and with it the lock
+    msync(heap, heap->_size, MS_SYNC);
+    munmap(heap, heap->_size);
+}
+
+size_t shared_heap_offset(SharedHeap *heap, void *ptr) {
+    return sharedOffset(heap, ptr);
+}
+
+void *shared_heap_pointer(SharedHeap *heap, size_t offset) {
+    return (char *) heap + offset;
+}
@@ -4,12 +4,29 @@
 // The various variables, functions, and structs associated
 // with the allocator are defined here.
 
+#ifndef MYMALLOC_H
+#define MYMALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Header of an object. Used both when the object is allocated and freed
 
+// Built with -DMYMALLOC_COMPACT_TAGS the tag is only the first word, which
+// saves 8 bytes per object. Bit 2 of it tells that the left block is free,
+// and only then is the left size stored: in the last word of the free left
+// block (its footer).
 typedef struct BoundaryTag {
   size_t _objectSizeAndAlloc; // Real size of the object (the last bit is used to
                               // check if the object is allocated
+#ifndef MYMALLOC_COMPACT_TAGS
   size_t _leftObjectSize;     // Real size of the previous contiguous chunk in memory
+#endif
 } BoundaryTag;
 
 struct FreeObject;
@@ -25,7 +42,7 @@ typedef struct FreeObject {   // Header used by objects that are free
   FreeListNode free_list_node;
 } FreeObject;
 
-#define getSize(obj)     (((obj)->_objectSizeAndAlloc) & ~1)
+#define getSize(obj)     (((obj)->_objectSizeAndAlloc) & 0x00fffffffffffff8UL)
 #define setSize(obj, size) \
   ((obj)->_objectSizeAndAlloc = (size) | isAllocated(obj))
 
@@ -33,33 +50,391 @@ typedef struct FreeObject {   // Header used by objects that are free
 #define setAllocated(obj, alloc) \
   ((obj)->_objectSizeAndAlloc = (alloc) | getSize(obj))
 
+// Bit 1 marks allocated objects picked by the heap profiler. It is
+// cleared whenever the size or allocated bit is rewritten.
+#define isSampled(obj)   (((obj)->_objectSizeAndAlloc) & 2)
+#define setSampled(obj)  ((obj)->_objectSizeAndAlloc |= 2)
+
+// The top byte of an allocated object's _objectSizeAndAlloc holds the
+// number of payload bytes that were not requested (rounding, minimum size)
+#define getPadding(obj)  (((obj)->_objectSizeAndAlloc) >> 56)
+#define setPadding(obj, pad) \
+  ((obj)->_objectSizeAndAlloc = \
+     ((obj)->_objectSizeAndAlloc & 0x00ffffffffffffffUL) | ((size_t) (pad) << 56))
+
 //STATE of the allocator
 // Size of the heap
-size_t _heapSize;
+extern size_t _heapSize;
 
 // initial memory pool
-void * _memStart;
+extern void * _memStart;
 
 // True if heap has been initialized
-int _initialized;
+extern int _initialized;
 
 // # malloc calls
-int _mallocCalls;
+extern int _mallocCalls;
 
 // # free calls
-int _freeCalls;
+extern int _freeCalls;
 
 // # realloc calls
-int _reallocCalls;
+extern int _reallocCalls;
 
 // # realloc calls
-int _callocCalls;
+extern int _callocCalls;
 
 // Free list
-FreeObject * _freeList;
-FreeObject _freeListSentinel;
+extern FreeObject * _freeList;
+extern FreeObject _freeListSentinel;
+
+// Free block counts are reported for power of two classes [32 << i, 64 << i);
+// the last class holds everything larger
+#define MALLOC_STATS_CLASSES 17
+
+typedef struct MallocStats {
+  size_t _heapSize;           // Bytes obtained from the OS
+  size_t _requestedBytes;     // Bytes asked for by the live objects
+  size_t _allocatedBytes;     // Bytes in allocated blocks, including the
+                              // BoundaryTag and rounding
+  size_t _freeBytes;          // Bytes in free blocks
+  size_t _largestFreeBlock;
+  size_t _freeBlocks;
+  size_t _freeBlocksPerClass[MALLOC_STATS_CLASSES];
+  size_t _residentBytes;      // RSS of the whole process
+  size_t _cachedChunks;       // Released chunks kept mapped for reuse
+  size_t _cachedBytes;        // (process-wide, like the three below)
+  size_t _chunkCacheHits;     // Chunk requests served from the cache
+  size_t _chunkCacheMisses;   // Chunk requests that went to the OS
+  size_t _slabBytes;          // Pages of the slabs that hold objects,
+                              // included in _heapSize
+  size_t _slabObjectBytes;    // Slab objects not free in their slab, also
+                              // while cached in a magazine or a thread's
+                              // page, at the size of their class. Included
+                              // in _allocatedBytes and _requestedBytes
+} MallocStats;
+
+// Region: objects are bump-allocated from chunks taken from the heap and
+// are only released all at once by region_reset or region_destroy.
+// A region must not be used by several threads at the same time.
+typedef struct RegionChunk {
+  struct RegionChunk * _next; // Chunk allocated before this one
+  size_t _size;               // Usable bytes after this header
+} RegionChunk;
+
+typedef struct Region {
+  RegionChunk * _chunks;      // Most recent chunk first
+  char * _cur;                // Next free byte in _chunks
+  char * _end;                // End of _chunks
+} Region;
+
+// Named heap: a heap with its own lock, free list and chunks. Its chunks
+// are mapped from the OS and are released all at once by heap_destroy,
+// or one at a time when they are completely free.
+typedef struct HeapChunk {
+  struct HeapChunk * _next;   // Chunk mapped before this one
+  size_t _size;               // Size of the mapping, this header included
+} HeapChunk;
+
+// Released chunks stay mapped in a small cache, oldest first, and are
+// handed out again for requests of the same size and origin before asking
+// the OS: the default heap only takes back chunks of its sbrk() area and
+// named heaps only mapped ones. They are unmapped when the cache is full
+// or after MYMALLOC_CHUNK_DECAY milliseconds.
+#define CHUNK_CACHE_SLOTS 8
+
+typedef struct CachedChunk {
+  void * _mem;
+  size_t _size;
+  int _mapped;                 // From mmap(), else from sbrk()
+  struct timespec _releasedAt; // CLOCK_MONOTONIC
+} CachedChunk;
+
+// Freed blocks of up to HEAP_QUICK_MAX bytes wait in per-size quick lists
+// when coalescing is deferred (MYMALLOC_DEFER_COALESCING)
+#define HEAP_QUICK_MAX 1024
+#define HEAP_QUICK_LISTS (HEAP_QUICK_MAX / 8 + 1)
+
+typedef struct Heap {
+  pthread_mutex_t _mutex;     // Protects everything below
+  FreeObject * _freeList;     // Points to _freeListSentinel
+  FreeObject _freeListSentinel;
+  HeapChunk * _chunks;        // Most recent chunk first (named heaps only)
+  size_t _heapSize;           // Bytes of the chunks, fence posts included
+  size_t _freeBytes;          // Bytes in free blocks
+  size_t _allocatedBytes;     // Bytes in allocated blocks, tags and padding
+                              // included
+  size_t _requestedBytes;     // Bytes asked for by the live objects
+  FreeObject * _quickLists[HEAP_QUICK_LISTS]; // Freed blocks by size / 8, still
+                              // marked allocated and linked by _next
+  size_t _quickBytes;         // Bytes in the quick lists (part of _freeBytes)
+  size_t _quickHits;          // Allocations served from the quick lists
+  FreeObject * _spareChunk;   // Chunk reserved ahead of need by the
+                              // maintenance thread, not in the free list
+  size_t _emptyChunks;        // Free blocks that span a whole chunk
+  int _index;                 // Slot in the heap table, -1 if none
+  void * _deferredFrees;      // Objects freed in signal handlers, linked by
+                              // their first word; not under _mutex
+  char _name[32];
+} Heap;
+
+// Slabs (MYMALLOC_SLABS): objects of up to SIZE_CLASS_MAX bytes come
+// from slabs of one size class each, one or two pages in a reserved region.
+// Slab objects have no boundary tag. A slab's free slots are tracked by a
+// bitmap that is kept apart from the slab's pages, in the first of the two
+// cache lines of its Slab descriptor, so finding a slot reads that line
+// instead of walking the objects themselves.
+#define SLAB_PAGE_SIZE 4096       // Page size of the size class tables
+#define SLAB_SPAN (2 * SLAB_PAGE_SIZE) // Bytes of the region per slab
+#define SLAB_MAP_WORDS 8          // 512 slots, the most a class has
+#define SLAB_REGION_SIZE (1UL << 30)
+#define CACHE_LINE 64
+
+typedef struct Slab {
+  uint64_t _freeMap[SLAB_MAP_WORDS]; // Bit i is set while slot i is free
+  struct Slab * _next;        // Partial slabs of the class, or empty slabs
+  struct Slab * _prev;
+  unsigned short _sizeClass;
+  unsigned short _freeSlots;
+  unsigned _sampled;          // Objects with a live profiler sample (atomic)
+  // With MYMALLOC_PAGE_FREE_LISTS the map is unused and the slab is a page
+  // owned by one thread; _next and _prev link the owner's pages of a class
+  void * _free;               // Objects to allocate from (owner only)
+  void * _localFree;          // Objects freed by the owner
+  void * _threadFree;         // Objects freed by other threads (atomic)
+  void * _owner;              // The owner's PageOwner, NULL if abandoned
+  size_t _used;               // Objects not in _free or _localFree
+} __attribute__((aligned(64))) Slab;
+
+typedef struct SlabClass {
+  pthread_mutex_t _mutex;     // Protects the class and the maps of its slabs
+  Slab * _partial;            // Slabs with at least one free slot
+  Slab * _abandoned;          // Pages whose owner thread has exited
+} SlabClass;
+
+// Size classes served from slabs (SIZE_CLASSES)
+#define SLAB_CLASSES 40
+
+// Magazines (MYMALLOC_MAGAZINES, with slabs): per-thread stacks of slab
+// objects of one class, traded whole with the class depot
+#define MAGAZINE_ROUNDS 32
+#define DEPOT_SLOTS 16
+
+typedef struct Magazine {
+  size_t _rounds;             // Objects in _objects
+  void * _objects[MAGAZINE_ROUNDS];
+} Magazine;
+
+typedef struct MagazineCache {
+  Magazine * _loaded[SLAB_CLASSES];   // Popped and pushed first
+  Magazine * _previous[SLAB_CLASSES]; // Swapped in when _loaded runs out
+} MagazineCache;
+
+typedef struct PageOwner {
+  Slab * _pages[SLAB_CLASSES]; // Current page of each class, in a ring
+} PageOwner;
+
+typedef struct Depot {
+  Magazine * _full[DEPOT_SLOTS];  // NULL or a magazine; exchanged atomically
+  Magazine * _empty[DEPOT_SLOTS];
+  size_t _fullTaken;              // Full magazines taken out so far (atomic)
+} Depot;
+
+// Emergency pool: a static pool for allocations that must not take a lock,
+// carved into blocks of power of two classes from EMERGENCY_BLOCK_MIN
+// bytes up, header included. Free blocks are kept in one lock-free stack
+// per class.
+#define EMERGENCY_POOL_SIZE (1 << 20)
+#define EMERGENCY_BLOCK_MIN 32
+#define EMERGENCY_CLASSES 12      // up to 64 KB
+
+typedef struct EmergencyBlock {
+  uint32_t _class;            // Blocks are EMERGENCY_BLOCK_MIN << _class bytes
+  uint32_t _next;             // Next free block of the class, 0 if none
+  uint64_t _pad;              // Keeps the payload 16-byte aligned
+} EmergencyBlock;
+
+// Shared heap: a heap that lives in a file mapped by several processes.
+// The mapping can sit at a different address in every process, so free
+// blocks are linked by their offset from the start of the SharedHeap
+// instead of by pointer, and objects are handed off as offsets.
+// The file format always uses full boundary tags
+typedef struct SharedBoundaryTag {
+  size_t _objectSizeAndAlloc;
+  size_t _leftObjectSize;
+} SharedBoundaryTag;
+
+typedef struct SharedFreeObject {
+  SharedBoundaryTag boundary_tag;
+  size_t _nextOffset;         // Offset of the next free block
+  size_t _prevOffset;         // Offset of the previous free block
+} SharedFreeObject;
+
+typedef struct SharedHeap {   // Lives at offset 0 of the file
+  size_t _magic;
+  size_t _size;               // Size of the file and of every mapping
+  pthread_mutex_t _mutex;     // Robust and process-shared
+  int _busy;                  // Set while the lock holder updates the heap
+  int _clean;                 // Set by persistent_heap_close
+  void * _base;               // Address the heap was created at
+  SharedFreeObject _freeListSentinel;
+  size_t _freeBytes;          // Bytes in free blocks
+  size_t _allocatedBytes;     // Bytes in allocated blocks, tags and padding
+                              // included
+  size_t _requestedBytes;     // Bytes asked for by the live objects
+  size_t _deferredFrees;      // Offset of the last object a signal handler
+                              // freed while the heap was locked, 0 if none
+                              // (atomic). Freed by the next lock holder.
+  size_t _root;               // Offset of an object the processes agree on,
+                              // 0 if none. Owned by the application.
+} SharedHeap;
 
 //FUNCTIONS
 //Prints the heap size and other information about the allocator
 void print();
 void print_list();
+
+// Fills stats with a consistent snapshot of the heap accounting
+void get_malloc_stats(MallocStats *stats);
+
+// Same as get_malloc_stats for a named heap. _heapSize is the size of the
+// heap's chunks and _residentBytes is still the RSS of the whole process.
+void heap_get_stats(Heap *heap, MallocStats *stats);
+
+// Prints the heap accounting and fragmentation to stderr
+void print_stats();
+
+// Allocates n objects of size bytes under a single lock acquisition,
+// carving them from the same free block where possible. Returns the number
+// of objects stored in ptrs; fewer than n only if memory ran out.
+size_t malloc_batch(size_t size, size_t n, void **ptrs);
+
+// Frees the n objects in ptrs (NULL entries are skipped). The heap objects
+// are freed under a single lock acquisition, and consecutive slab objects
+// of one class under one lock of their class.
+void free_batch(void **ptrs, size_t n);
+
+// Region API. region_alloc returns 8-byte aligned memory, or NULL with
+// errno set. region_reset drops every object of the region and keeps one
+// standard-sized chunk for reuse; region_destroy gives all of its memory
+// back to the heap.
+Region *region_create();
+void *region_alloc(Region *region, size_t size);
+void region_reset(Region *region);
+void region_destroy(Region *region);
+
+// Named heap API. Objects of a named heap must be freed with heap_free on
+// the same heap, never with free(). heap_destroy releases every object of
+// the heap at once, so they must not be used afterwards. heap_memalign
+// aligns the object to alignment, a power of two. heap_create takes no
+// size hint: a heap maps its first chunk on its first allocation and
+// grows one 2MB chunk at a time.
+Heap *heap_create(const char *name);
+void *heap_malloc(Heap *heap, size_t size);
+void *heap_memalign(Heap *heap, size_t alignment, size_t size);
+void heap_free(Heap *heap, void *ptr);
+void heap_destroy(Heap *heap);
+
+// Extended allocation API. flags is 0 or an | of the MALLOCX_ values:
+#define MALLOCX_LG_ALIGN(la)  ((int) (la))      // align to 1 << la bytes
+#define MALLOCX_ALIGN(a)      ((int) __builtin_ctzl(a)) // a is a power of two
+#define MALLOCX_ZERO          ((int) 0x40)      // zero the new bytes
+#define MALLOCX_TCACHE_NONE   ((int) 0x80)      // bypass the per-thread caches
+#define MALLOCX_HEAP(index)   ((int) (((index) + 1) << 8)) // see heap_index
+#define MALLOCX_CACHE_LINE    ((int) 0x100000)  // own whole cache lines
+#define MALLOCX_HEAPS 64                        // named heaps with an index
+
+// mallocx and rallocx return NULL with errno set on failure, rallocx
+// leaving ptr valid. xallocx only resizes ptr in place, to size + extra
+// bytes if it can and to at least size otherwise, and returns the usable
+// size ptr ends up with, which is less than size if it could not grow.
+// sallocx returns the usable size of ptr, and nallocx the usable size
+// mallocx gives at least for size and flags (exactly, for slab objects),
+// or 0 if the request cannot be met. An object of a named heap must be
+// passed with its MALLOCX_HEAP flag. Objects mostly grow in place only
+// with MYMALLOC_ADDRESS_ORDERED, where blocks are carved from their low
+// end and leave the free rest on the right of the object.
+void *mallocx(size_t size, int flags);
+void *rallocx(void *ptr, size_t size, int flags);
+size_t xallocx(void *ptr, size_t size, size_t extra, int flags);
+size_t sallocx(const void *ptr, int flags);
+size_t nallocx(size_t size, int flags);
+void dallocx(void *ptr, int flags);
+
+// Index of a named heap for MALLOCX_HEAP. The first MALLOCX_HEAPS live
+// heaps get one; -1 for the others and for the default heap, and
+// MALLOCX_HEAP(-1) is the default heap.
+int heap_index(Heap *heap);
+
+// Shared heap API. shared_heap_open maps the heap in path, creating it
+// with the given size if the file is empty; size is ignored otherwise. The
+// heap never grows. Objects may be freed by any process that has the heap
+// open. If a process dies in the middle of an update, the heap can not be
+// repaired and every later call fails with ENOTRECOVERABLE. Opening fails
+// with EBUSY instead of waiting while another process creates the heap.
+// In a signal handler that interrupted the allocator, shared_heap_malloc
+// does not wait for the heap's lock, which the interrupted code may hold:
+// it fails with EDEADLK if the heap is locked, and shared_heap_free then
+// leaves the object to the next caller that takes the lock.
+SharedHeap *shared_heap_open(const char *path, size_t size);
+void *shared_heap_malloc(SharedHeap *heap, size_t size);
+void shared_heap_free(SharedHeap *heap, void *ptr);
+void shared_heap_close(SharedHeap *heap);
+
+// Persistent heap API. A persistent heap is a shared heap that one process
+// at a time keeps across runs. persistent_heap_open creates it at addr (or
+// where the kernel picks if addr is NULL) and maps it at the same address
+// on every later open, so pointers stored in it stay valid and _root can
+// hold the root of the application's data. A fixed addr far from the
+// program's other mappings makes restoring reliable; EEXIST means the
+// address is already in use, and EBUSY that another process has the heap
+// open. A heap that was not closed with persistent_heap_close is checked
+// block by block and rejected with EINVAL if its boundary tags or free
+// list are damaged. Use the shared_heap_* functions to allocate and free.
+SharedHeap *persistent_heap_open(const char *path, size_t size, void *addr);
+void persistent_heap_close(SharedHeap *heap);
+
+// Convert between an object's address in this process and its offset,
+// which is the same in every process
+size_t shared_heap_offset(SharedHeap *heap, void *ptr);
+void *shared_heap_pointer(SharedHeap *heap, size_t offset);
+
+// Signal-safe allocation. A malloc, calloc, realloc, posix_memalign or free
+// that a signal handler makes while its thread is already inside the
+// allocator is served from the emergency pool with atomic operations only,
+// instead of waiting for a lock the thread itself holds. A heap object
+// freed that way is queued and freed by the next free() outside a handler.
+// mallocx, malloc_batch, heap_malloc and the other allocating functions
+// fall back on the pool in the same way, or fail with ENOMEM where the
+// pool cannot serve them (large alignments, a region that has to grow,
+// heap_create, region_create); their frees are queued on the object's
+// heap. Destroying a named heap, the stats and the profile dump must not
+// be called from such a handler.
+// Handlers can also call signal_safe_malloc, which always allocates from
+// the pool, and signal_safe_free, which frees a pool object at once and
+// queues any other. Pool objects may be freed with free() as well.
+void *signal_safe_malloc(size_t size);
+void signal_safe_free(void *ptr);
+
+// Writes the live sampled allocations to path in the pprof heap profile
+// format. Returns 0 on success, -1 with errno set otherwise.
+int heap_profile_dump(const char *path);
+
+// The allocation functions live in their own section, so the profiler can
+// drop their frames from the top of a sampled stack whether or not they
+// were inlined
+#define MYMALLOC_TEXT __attribute__((section("mymalloc_text")))
+
+// Writes the buffered allocation trace records to the MYMALLOC_TRACE file
+void malloc_trace_flush();
+
+// MyMallocNew.cc replaces the global operator new and delete with calls to
+// malloc, posix_memalign and free. The size passed to the sized forms of
+// operator delete is not used: free() reads the object's boundary tag or
+// slab anyway, so the size would not save a metadata read.
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
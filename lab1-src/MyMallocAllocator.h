@@ -0,0 +1,286 @@
+//
+// CS252: MyMalloc C++ allocator adaptors
+//
+// Lets C++ containers allocate from a specific MyMalloc heap or region:
+//
+//   HeapResource      std::pmr::memory_resource over a named heap (or the
+//                     default heap)
+//   RegionResource    std::pmr::memory_resource over a region; deallocate
+//                     does nothing, the region is reset as a whole
+//   Allocator<T>      stateless STL allocator over malloc and free
+//   PoolAllocator<T>  stateless STL allocator for node-based containers
+//                     (std::map, std::list, ...). The size class of T is
+//                     picked at compile time from the tables in
+//                     MyMallocSizeClasses.h, and single objects come from a
+//                     thread-local pool of blocks of that class, so
+//                     allocating a node costs a pop instead of a heap
+//                     search. With MYMALLOC_SLABS the pool is refilled from
+//                     and drained to the class's slabs in batches; it never
+//                     keeps more than a few hundred free blocks.
+//
+// The pmr resources need C++17.
+//
+
+#ifndef MYMALLOC_ALLOCATOR_H
+#define MYMALLOC_ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <stdlib.h>
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
+#include "MyMalloc.h"
+#include "MyMallocSizeClasses.h"
+
+namespace mymalloc {
+
+#if __cplusplus >= 201703L
+
+class HeapResource : public std::pmr::memory_resource {
+public:
+    // heap == nullptr allocates from the default heap
+    explicit HeapResource(Heap *heap = nullptr) : _heap(heap) {}
+
+    Heap *heap() const { return _heap; }
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        if (bytes == 0)
+            bytes = 1;
+        void *ptr;
+        if (_heap == nullptr) {
+            if (alignment <= 8)
+                ptr = malloc(bytes);
+            else if (posix_memalign(&ptr, alignment, bytes) != 0)
+                ptr = nullptr;
+        } else {
+            ptr = alignment <= 8 ? heap_malloc(_heap, bytes) : heap_memalign(_heap, alignment, bytes);
+        }
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t, std::size_t) override {
+        if (_heap == nullptr)
+            free(ptr);
+        else
+            heap_free(_heap, ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        const HeapResource *o = dynamic_cast<const HeapResource *>(&other);
+        return o != nullptr && o->_heap == _heap;
+    }
+
+    Heap *_heap;
+};
+
+class RegionResource : public std::pmr::memory_resource {
+public:
+    explicit RegionResource(Region *region) : _region(region) {}
+
+    Region *region() const { return _region; }
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        // region_alloc aligns to 8 bytes; over-allocate for more
+        std::size_t extra = alignment > 8 ? alignment - 8 : 0;
+        void *ptr = region_alloc(_region, bytes + extra);
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+        std::uintptr_t p = reinterpret_cast<std::uintptr_t>(ptr);
+        return reinterpret_cast<void *>((p + alignment - 1) & ~(std::uintptr_t) (alignment - 1));
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        const RegionResource *o = dynamic_cast<const RegionResource *>(&other);
+        return o != nullptr && o->_region == _region;
+    }
+
+    Region *_region;
+};
+
+#endif
+
+template <class T>
+class Allocator {
+public:
+    typedef T value_type;
+
+    Allocator() noexcept {}
+    template <class U>
+    Allocator(const Allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        if (n > SIZE_MAX / sizeof(T))
+            throw std::bad_alloc();
+        void *ptr = malloc(n * sizeof(T));
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T *ptr, std::size_t) noexcept {
+        free(ptr);
+    }
+};
+
+template <class T, class U>
+bool operator==(const Allocator<T> &, const Allocator<U> &) { return true; }
+
+template <class T, class U>
+bool operator!=(const Allocator<T> &, const Allocator<U> &) { return false; }
+
+namespace detail {
+
+// Same mapping as sizeClass() in MyMalloc.c; SIZE_CLASSES for sizes above
+// SIZE_CLASS_MAX
+constexpr unsigned sizeClass(std::size_t size) {
+    return size <= SIZE_CLASS_MAX ? _sizeClassIndex[(size + 7) >> 3] : SIZE_CLASSES;
+}
+
+// Thread-local free list of blocks of ObjectSize bytes. It is refilled
+// with malloc_batch and gives blocks back with free_batch, kRefill at a
+// time, once it holds more than kHighWater of them and when the thread
+// exits. For a slab class both go through the slab batch paths. A block
+// freed by another thread joins that thread's list. Once the pool of a
+// thread is destroyed, destructors of other thread-locals that still
+// allocate fall back on malloc and free.
+template <std::size_t ObjectSize>
+class Pool {
+public:
+    static const std::size_t kRefill = 64;
+    static const std::size_t kHighWater = 4 * kRefill;
+
+    static void *allocate() {
+        if (destroyed()) {
+            void *ptr = malloc(ObjectSize);
+            if (ptr == nullptr)
+                throw std::bad_alloc();
+            return ptr;
+        }
+        Pool &pool = local();
+        if (pool._free == nullptr)
+            pool.refill();
+        FreeBlock *block = pool._free;
+        pool._free = block->_next;
+        pool._count--;
+        return block;
+    }
+
+    static void deallocate(void *ptr) {
+        if (destroyed()) {
+            free(ptr);
+            return;
+        }
+        Pool &pool = local();
+        pool.push(ptr);
+        if (pool._count > kHighWater)
+            pool.drain();
+    }
+
+    // Free blocks in the pool of the calling thread
+    static std::size_t freeBlocks() {
+        return destroyed() ? 0 : local()._count;
+    }
+
+    ~Pool() {
+        while (_free != nullptr)
+            drain();
+        destroyed() = true;
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock *_next;
+    };
+
+    static Pool &local() {
+        static thread_local Pool pool;
+        return pool;
+    }
+
+    // Set when the thread's pool is destroyed; a bool has no destructor,
+    // so it can be read until the thread is gone
+    static bool &destroyed() {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+    void push(void *ptr) {
+        FreeBlock *block = static_cast<FreeBlock *>(ptr);
+        block->_next = _free;
+        _free = block;
+        _count++;
+    }
+
+    void refill() {
+        void *ptrs[kRefill];
+        std::size_t n = malloc_batch(ObjectSize, kRefill, ptrs);
+        if (n == 0)
+            throw std::bad_alloc();
+        for (std::size_t i = 0; i < n; i++)
+            push(ptrs[i]);
+    }
+
+    // Gives up to kRefill blocks back with one free_batch
+    void drain() {
+        void *ptrs[kRefill];
+        std::size_t n = 0;
+        for (; n < kRefill && _free != nullptr; n++) {
+            ptrs[n] = _free;
+            _free = _free->_next;
+        }
+        _count -= n;
+        free_batch(ptrs, n);
+    }
+
+    FreeBlock *_free = nullptr;
+    std::size_t _count = 0;     // Blocks in _free
+};
+
+} // namespace detail
+
+template <class T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    // The size class of T and its block size, fixed at compile time. Types
+    // larger than SIZE_CLASS_MAX get their 8-byte rounded size.
+    static constexpr unsigned kSizeClass = detail::sizeClass(sizeof(T));
+    static constexpr std::size_t kObjectSize =
+        kSizeClass < SIZE_CLASSES ? _classSize[kSizeClass] : (sizeof(T) + 7) & ~(std::size_t) 7;
+
+    PoolAllocator() noexcept {}
+    template <class U>
+    PoolAllocator(const PoolAllocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        if (n == 1 && alignof(T) <= 8)
+            return static_cast<T *>(detail::Pool<kObjectSize>::allocate());
+        return Allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept {
+        if (n == 1 && alignof(T) <= 8)
+            detail::Pool<kObjectSize>::deallocate(ptr);
+        else
+            free(ptr);
+    }
+};
+
+template <class T, class U>
+bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &) { return true; }
+
+template <class T, class U>
+bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &) { return false; }
+
+} // namespace mymalloc
+
+#endif
@@ -0,0 +1,158 @@
+//
+// CS252: MyMalloc C++ allocation functions
+//
+// Replaces the global operator new and delete, so that C++ programs that
+// run with MyMalloc.so allocate straight from its malloc and
+// posix_memalign instead of going through the libstdc++ wrappers.
+//
+// The sized forms of operator delete ignore the size: freeObject() reads
+// the boundary tag of the object anyway to coalesce it with its
+// neighbours.
+//
+// The allocating functions are MYMALLOC_TEXT like malloc, so a sampled
+// stack in a heap profile starts at the caller of new.
+//
+
+#include <new>
+#include <cstdlib>
+#include "MyMalloc.h"
+
+namespace {
+
+// Calls the new handler until the allocation succeeds, or throws
+// bad_alloc if there is no handler
+MYMALLOC_TEXT void *allocate(std::size_t size) {
+    // every operator new call returns a distinct object
+    if (size == 0)
+        size = 1;
+    for (;;) {
+        void *ptr = malloc(size);
+        if (ptr != nullptr)
+            return ptr;
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+MYMALLOC_TEXT void *allocateNoThrow(std::size_t size) noexcept {
+    try {
+        return allocate(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+#if __cpp_aligned_new
+MYMALLOC_TEXT void *allocateAligned(std::size_t size, std::align_val_t alignment) {
+    std::size_t align = static_cast<std::size_t>(alignment);
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    if (size == 0)
+        size = 1;
+    for (;;) {
+        void *ptr;
+        if (posix_memalign(&ptr, align, size) == 0)
+            return ptr;
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+MYMALLOC_TEXT void *allocateAlignedNoThrow(std::size_t size, std::align_val_t alignment) noexcept {
+    try {
+        return allocateAligned(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+#endif
+
+} // namespace
+
+MYMALLOC_TEXT void *operator new(std::size_t size) {
+    return allocate(size);
+}
+
+MYMALLOC_TEXT void *operator new[](std::size_t size) {
+    return allocate(size);
+}
+
+MYMALLOC_TEXT void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return allocateNoThrow(size);
+}
+
+MYMALLOC_TEXT void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return allocateNoThrow(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+    free(ptr);
+}
+
+#if __cpp_sized_deallocation
+void operator delete(void *ptr, std::size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept {
+    free(ptr);
+}
+#endif
+
+#if __cpp_aligned_new
+MYMALLOC_TEXT void *operator new(std::size_t size, std::align_val_t alignment) {
+    return allocateAligned(size, alignment);
+}
+
+MYMALLOC_TEXT void *operator new[](std::size_t size, std::align_val_t alignment) {
+    return allocateAligned(size, alignment);
+}
+
+MYMALLOC_TEXT void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return allocateAlignedNoThrow(size, alignment);
+}
+
+MYMALLOC_TEXT void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return allocateAlignedNoThrow(size, alignment);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    free(ptr);
+}
+#endif
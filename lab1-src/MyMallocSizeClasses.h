@@ -0,0 +1,59 @@
+//
+// CS252: MyMalloc size classes
+//
+// Generated by sizeclasses.c. Do not edit.
+//
+
+#ifndef MYMALLOC_SIZE_CLASSES_H
+#define MYMALLOC_SIZE_CLASSES_H
+
+#define SIZE_CLASSES 40
+#define SIZE_CLASS_MAX 1024
+
+// The tables are constant expressions in C++, for PoolAllocator
+#ifdef __cplusplus
+#define SIZE_CLASS_TABLE static constexpr
+#else
+#define SIZE_CLASS_TABLE static const
+#endif
+
+// Class of the sizes up to SIZE_CLASS_MAX, indexed by (size + 7) >> 3
+SIZE_CLASS_TABLE unsigned char _sizeClassIndex[129] = {
+    0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+    15, 16, 16, 17, 17, 18, 18, 19, 19, 20, 20, 21, 21, 22, 22, 23,
+    23, 24, 24, 24, 24, 25, 25, 25, 25, 26, 26, 26, 26, 27, 27, 27,
+    27, 28, 28, 28, 28, 29, 29, 29, 29, 30, 30, 30, 30, 31, 31, 31,
+    31, 32, 32, 32, 32, 32, 32, 32, 32, 33, 33, 33, 33, 33, 33, 33,
+    33, 34, 34, 34, 34, 34, 34, 34, 34, 35, 35, 35, 35, 35, 35, 35,
+    35, 36, 36, 36, 36, 36, 36, 36, 36, 37, 37, 37, 37, 37, 37, 37,
+    37, 38, 38, 38, 38, 38, 38, 38, 38, 39, 39, 39, 39, 39, 39, 39,
+    39
+};
+
+// Largest request size of each class
+SIZE_CLASS_TABLE unsigned int _classSize[40] = {
+    8, 16, 24, 32, 40, 48, 56, 64,
+    72, 80, 88, 96, 104, 112, 120, 128,
+    144, 160, 176, 192, 208, 224, 240, 256,
+    288, 320, 352, 384, 416, 448, 480, 512,
+    576, 640, 704, 768, 832, 896, 960, 1024
+};
+
+// Pages per slab and objects per slab of each class
+SIZE_CLASS_TABLE unsigned short _classSlabPages[40] = {
+    1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1,
+    2, 2, 2, 2, 2, 2, 2, 2
+};
+
+SIZE_CLASS_TABLE unsigned short _classSlabObjects[40] = {
+    512, 256, 170, 128, 102, 85, 73, 64,
+    56, 51, 46, 42, 39, 36, 34, 32,
+    28, 25, 23, 21, 19, 18, 17, 16,
+    14, 12, 11, 10, 9, 9, 8, 8,
+    14, 12, 11, 10, 9, 9, 8, 8
+};
+
+#endif
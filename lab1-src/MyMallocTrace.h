@@ -0,0 +1,35 @@
+//
+// CS252: MyMalloc allocation trace format
+//
+// Layout of the binary trace written when MYMALLOC_TRACE is set and read
+// back by the replay tool. A trace is a TraceHeader followed by TraceRecords.
+// Records of one thread are in order; records of different threads are
+// interleaved in blocks and have to be sorted by timestamp to replay them.
+
+#include <stdint.h>
+
+#define TRACE_MAGIC   0x31454341525442ULL   // "BTRACE1"
+#define TRACE_VERSION 1
+
+enum TraceOp {
+  TRACE_MALLOC = 1,
+  TRACE_FREE = 2,
+  TRACE_REALLOC = 3,
+  TRACE_CALLOC = 4
+};
+
+typedef struct TraceHeader {
+  uint64_t _magic;
+  uint32_t _version;
+  uint32_t _recordSize;       // sizeof(TraceRecord) of the writer
+} TraceHeader;
+
+typedef struct TraceRecord {
+  uint64_t _timestamp;        // CLOCK_MONOTONIC, nanoseconds
+  uint64_t _ptr;              // Address returned, or freed for TRACE_FREE
+  uint64_t _oldPtr;           // Address passed to realloc, 0 otherwise
+  uint32_t _size;             // Requested bytes, saturated at UINT32_MAX
+  uint16_t _thread;           // Small id assigned on the thread's first call
+  uint8_t _op;                // enum TraceOp
+  uint8_t _pad;
+} TraceRecord;
@@ -0,0 +1,511 @@
+//
+// CS252: MyMalloc benchmark suite
+//
+// Runs the usual allocator stress patterns at several thread counts, once
+// with the libc allocator and once with MyMalloc.so preloaded, and prints
+// ops/sec and peak RSS side by side:
+//
+//   ./bench [-t 1,2,4,8] [-s scale] [-l ./MyMalloc.so] [benchmark ...]
+//
+// Each run is a separate process (this binary re-executed with --run) so
+// that the two allocators never share a heap and wait4() reports the peak
+// RSS of that run alone.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define MAX_THREADS 64
+#define RESULT_FD 3             // where a --run child reports its result
+#define RUN_TIMEOUT 120         // seconds before a run is considered hung
+
+extern char **environ;
+
+static double _scale = 1.0;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t nextRandom(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static long scaled(long n) {
+    return (long) (n * _scale) > 0 ? (long) (n * _scale) : 1;
+}
+
+static void runThreads(int threads, void *(*fn)(void *), void *args, size_t argSize) {
+    pthread_t tids[MAX_THREADS];
+    for (int i = 0; i < threads; i++)
+        pthread_create(&tids[i], NULL, fn, (char *) args + i * argSize);
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+}
+
+//
+// Larson: server simulation. Every round a fresh set of threads takes over
+// the slot arrays of the previous round and keeps replacing random objects,
+// so most objects are freed by a different thread than the one that
+// allocated them.
+//
+
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 10
+
+typedef struct LarsonState {
+    void *_slots[LARSON_SLOTS];
+    long _ops;
+    uint64_t _random;
+} LarsonState;
+
+static void *larsonWorker(void *arg) {
+    LarsonState *s = arg;
+    for (long i = 0; i < s->_ops; i++) {
+        int k = nextRandom(&s->_random) % LARSON_SLOTS;
+        free(s->_slots[k]);
+        size_t size = 16 + nextRandom(&s->_random) % 240;
+        s->_slots[k] = malloc(size);
+        *(char *) s->_slots[k] = 1;
+    }
+    return NULL;
+}
+
+static long larson(int threads) {
+    LarsonState *states = calloc(threads, sizeof(LarsonState));
+    for (int t = 0; t < threads; t++) {
+        states[t]._random = 0x9E3779B97F4A7C15ULL * (t + 1);
+        states[t]._ops = scaled(100000);
+        for (int k = 0; k < LARSON_SLOTS; k++)
+            states[t]._slots[k] = malloc(16 + nextRandom(&states[t]._random) % 240);
+    }
+    for (int round = 0; round < LARSON_ROUNDS; round++)
+        runThreads(threads, larsonWorker, states, sizeof(LarsonState));
+    for (int t = 0; t < threads; t++) {
+        for (int k = 0; k < LARSON_SLOTS; k++)
+            free(states[t]._slots[k]);
+    }
+    long ops = 2L * threads * LARSON_ROUNDS * states[0]._ops;
+    free(states);
+    return ops;
+}
+
+//
+// xmalloc: producer threads allocate, consumer threads free. Producers and
+// consumers are paired through single-producer single-consumer rings.
+//
+
+#define XMALLOC_RING 1024
+
+typedef struct XmallocPair {
+    void *_ring[XMALLOC_RING];
+    _Atomic long _head;
+    _Atomic long _tail;
+    long _ops;
+} XmallocPair;
+
+typedef struct XmallocArgs {
+    XmallocPair *_pair;
+    int _producer;
+} XmallocArgs;
+
+static void *xmallocWorker(void *arg) {
+    XmallocArgs *a = arg;
+    XmallocPair *p = a->_pair;
+    for (long i = 0; i < p->_ops; i++) {
+        if (a->_producer) {
+            while (i - atomic_load(&p->_tail) >= XMALLOC_RING)
+                sched_yield();
+            void *obj = malloc(16 + i % 112);
+            *(char *) obj = 1;
+            p->_ring[i % XMALLOC_RING] = obj;
+            atomic_store(&p->_head, i + 1);
+        } else {
+            while (atomic_load(&p->_head) <= i)
+                sched_yield();
+            free(p->_ring[i % XMALLOC_RING]);
+            atomic_store(&p->_tail, i + 1);
+        }
+    }
+    return NULL;
+}
+
+static long xmalloc(int threads) {
+    long ops = scaled(1000000);
+    if (threads == 1) {
+        // no one to hand off to: allocate a ring's worth, then free it
+        void *ring[XMALLOC_RING];
+        for (long i = 0; i < ops; i += XMALLOC_RING) {
+            for (int k = 0; k < XMALLOC_RING; k++) {
+                ring[k] = malloc(16 + k % 112);
+                *(char *) ring[k] = 1;
+            }
+            for (int k = 0; k < XMALLOC_RING; k++)
+                free(ring[k]);
+        }
+        return 2 * ((ops + XMALLOC_RING - 1) / XMALLOC_RING) * XMALLOC_RING;
+    }
+    int pairs = threads / 2;
+    XmallocPair *p = calloc(pairs, sizeof(XmallocPair));
+    XmallocArgs *args = calloc(2 * pairs, sizeof(XmallocArgs));
+    for (int i = 0; i < 2 * pairs; i++) {
+        p[i / 2]._ops = ops;
+        args[i]._pair = &p[i / 2];
+        args[i]._producer = i % 2 == 0;
+    }
+    runThreads(2 * pairs, xmallocWorker, args, sizeof(XmallocArgs));
+    free(args);
+    free(p);
+    return 2L * pairs * ops;
+}
+
+//
+// threadtest: every thread repeatedly allocates a batch of small objects
+// and frees all of them.
+//
+
+#define THREADTEST_BATCH 1000
+
+typedef struct ThreadtestArgs {
+    long _iterations;
+} ThreadtestArgs;
+
+static void *threadtestWorker(void *arg) {
+    ThreadtestArgs *a = arg;
+    void *objs[THREADTEST_BATCH];
+    for (long it = 0; it < a->_iterations; it++) {
+        for (int i = 0; i < THREADTEST_BATCH; i++) {
+            objs[i] = malloc(8);
+            *(char *) objs[i] = 1;
+        }
+        for (int i = 0; i < THREADTEST_BATCH; i++)
+            free(objs[i]);
+    }
+    return NULL;
+}
+
+static long threadtest(int threads) {
+    ThreadtestArgs args[MAX_THREADS];
+    for (int t = 0; t < threads; t++)
+        args[t]._iterations = scaled(1000) / threads + 1;
+    runThreads(threads, threadtestWorker, args, sizeof(ThreadtestArgs));
+    return 2L * threads * args[0]._iterations * THREADTEST_BATCH;
+}
+
+//
+// churn: random mallocs and frees of sizes from 16 bytes to 4 KB, biased to
+// small sizes, over a working set of slots.
+//
+
+#define CHURN_SLOTS 512
+
+typedef struct ChurnArgs {
+    long _ops;
+    uint64_t _random;
+} ChurnArgs;
+
+static void *churnWorker(void *arg) {
+    ChurnArgs *a = arg;
+    void *slots[CHURN_SLOTS] = { 0 };
+    for (long i = 0; i < a->_ops; i++) {
+        int k = nextRandom(&a->_random) % CHURN_SLOTS;
+        if (slots[k] != NULL) {
+            free(slots[k]);
+            slots[k] = NULL;
+        } else {
+            int shift = 4 + nextRandom(&a->_random) % 9;
+            size_t size = (1UL << shift) + nextRandom(&a->_random) % (1UL << shift);
+            slots[k] = malloc(size > 4096 ? 4096 : size);
+            *(char *) slots[k] = 1;
+        }
+    }
+    for (int k = 0; k < CHURN_SLOTS; k++)
+        free(slots[k]);
+    return NULL;
+}
+
+static long churn(int threads) {
+    ChurnArgs args[MAX_THREADS];
+    for (int t = 0; t < threads; t++) {
+        args[t]._ops = scaled(1000000) / threads + 1;
+        args[t]._random = 0x2545F4914F6CDD1DULL * (t + 1);
+    }
+    runThreads(threads, churnWorker, args, sizeof(ChurnArgs));
+    return threads * args[0]._ops;
+}
+
+//
+// cache-scratch: passive false sharing. The main thread allocates one small
+// object per thread back to back; each thread frees the one it was given,
+// allocates its own and writes it over and over. If the allocator hands the
+// freed neighbouring slots back out, the threads fight over cache lines.
+// cache-thrash is the active variant without the initial hand-off.
+// MYMALLOC_CACHE_LINES keeps every thread's objects on lines of their own.
+//
+
+#define SCRATCH_OBJECT 8
+#define SCRATCH_WRITES 1000
+
+typedef struct ScratchArgs {
+    char *_given;
+    long _iterations;
+} ScratchArgs;
+
+static void *scratchWorker(void *arg) {
+    ScratchArgs *a = arg;
+    free(a->_given);
+    for (long it = 0; it < a->_iterations; it++) {
+        volatile char *obj = malloc(SCRATCH_OBJECT);
+        for (int w = 0; w < SCRATCH_WRITES; w++) {
+            for (int j = 0; j < SCRATCH_OBJECT; j++)
+                obj[j]++;
+        }
+        free((void *) obj);
+    }
+    return NULL;
+}
+
+static long cacheScratch(int threads, int passive) {
+    ScratchArgs args[MAX_THREADS];
+    for (int t = 0; t < threads; t++) {
+        args[t]._given = passive ? malloc(SCRATCH_OBJECT) : NULL;
+        args[t]._iterations = scaled(2000);
+    }
+    runThreads(threads, scratchWorker, args, sizeof(ScratchArgs));
+    return threads * args[0]._iterations * SCRATCH_WRITES;
+}
+
+static long cacheScratchPassive(int threads) {
+    return cacheScratch(threads, 1);
+}
+
+static long cacheThrash(int threads) {
+    return cacheScratch(threads, 0);
+}
+
+//
+// realloc: grow a buffer by 50% at a time up to 1 MB, touching the new end
+// each time, then free it.
+//
+
+#define REALLOC_LIMIT (1 << 20)
+
+typedef struct ReallocArgs {
+    long _iterations;
+    long _ops;
+} ReallocArgs;
+
+static void *reallocWorker(void *arg) {
+    ReallocArgs *a = arg;
+    for (long it = 0; it < a->_iterations; it++) {
+        char *p = NULL;
+        for (size_t size = 16; size <= REALLOC_LIMIT; size += size / 2) {
+            p = realloc(p, size);
+            p[size - 1] = 1;
+            a->_ops++;
+        }
+        free(p);
+    }
+    return NULL;
+}
+
+static long reallocGrowth(int threads) {
+    ReallocArgs args[MAX_THREADS];
+    for (int t = 0; t < threads; t++) {
+        args[t]._iterations = scaled(200);
+        args[t]._ops = 0;
+    }
+    runThreads(threads, reallocWorker, args, sizeof(ReallocArgs));
+    long ops = 0;
+    for (int t = 0; t < threads; t++)
+        ops += args[t]._ops;
+    return ops;
+}
+
+typedef struct Benchmark {
+    const char *_name;
+    long (*_run)(int threads);
+} Benchmark;
+
+static Benchmark _benchmarks[] = {
+    { "larson", larson },
+    { "xmalloc", xmalloc },
+    { "threadtest", threadtest },
+    { "churn", churn },
+    { "cache-scratch", cacheScratchPassive },
+    { "cache-thrash", cacheThrash },
+    { "realloc", reallocGrowth },
+};
+
+#define NUM_BENCHMARKS ((int) (sizeof(_benchmarks) / sizeof(_benchmarks[0])))
+
+static Benchmark *findBenchmark(const char *name) {
+    for (int i = 0; i < NUM_BENCHMARKS; i++) {
+        if (strcmp(_benchmarks[i]._name, name) == 0)
+            return &_benchmarks[i];
+    }
+    return NULL;
+}
+
+typedef struct RunResult {
+    int _ok;
+    double _opsPerSec;
+    long _peakRSS;              // KB
+} RunResult;
+
+/**
+ * @brief Runs one benchmark in a child process, with preload as LD_PRELOAD
+ * or with LD_PRELOAD removed when preload is NULL
+ */
+static RunResult runChild(const char *name, int threads, const char *preload) {
+    RunResult result = { 0, 0, 0 };
+    int fds[2];
+    if (pipe(fds) < 0)
+        return result;
+
+    char threadsArg[16], scaleArg[32], preloadEnv[4096];
+    snprintf(threadsArg, sizeof(threadsArg), "%d", threads);
+    snprintf(scaleArg, sizeof(scaleArg), "%g", _scale);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int n = 0;
+        for (char **e = environ; *e != NULL; e++)
+            n++;
+        char **env = calloc(n + 2, sizeof(char *));
+        int k = 0;
+        for (char **e = environ; *e != NULL; e++) {
+            if (strncmp(*e, "LD_PRELOAD=", 11) != 0)
+                env[k++] = *e;
+        }
+        if (preload != NULL) {
+            snprintf(preloadEnv, sizeof(preloadEnv), "LD_PRELOAD=%s", preload);
+            env[k++] = preloadEnv;
+        }
+        env[k] = NULL;
+
+        dup2(fds[1], RESULT_FD);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 1);
+        alarm(RUN_TIMEOUT);
+        char *argv[] = { "bench", "--run", (char *) name, threadsArg, scaleArg, NULL };
+        execve("/proc/self/exe", argv, env);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    char buf[128];
+    ssize_t len = read(fds[0], buf, sizeof(buf) - 1);
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (pid < 0 || wait4(pid, &status, 0, &usage) < 0)
+        return result;
+    if (len > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        buf[len] = '\0';
+        long ops;
+        double elapsed;
+        if (sscanf(buf, "%ld %lf", &ops, &elapsed) == 2 && elapsed > 0) {
+            result._ok = 1;
+            result._opsPerSec = ops / elapsed;
+            result._peakRSS = usage.ru_maxrss;
+        }
+    }
+    return result;
+}
+
+static void printResult(RunResult r) {
+    if (r._ok)
+        printf("  %14.0f %10ld", r._opsPerSec, r._peakRSS);
+    else
+        printf("  %14s %10s", "failed", "-");
+}
+
+int main(int argc, char **argv) {
+    if (argc == 5 && strcmp(argv[1], "--run") == 0) {
+        Benchmark *b = findBenchmark(argv[2]);
+        int threads = atoi(argv[3]);
+        _scale = atof(argv[4]);
+        if (b == NULL || threads < 1 || threads > MAX_THREADS)
+            return 1;
+        double start = now();
+        long ops = b->_run(threads);
+        double elapsed = now() - start;
+        dprintf(RESULT_FD, "%ld %.9f\n", ops, elapsed);
+        return 0;
+    }
+
+    int threadCounts[MAX_THREADS] = { 1, 2, 4, 8 };
+    int numThreadCounts = 4;
+    const char *library = "./MyMalloc.so";
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:l:")) != -1) {
+        switch (opt) {
+        case 't':
+            numThreadCounts = 0;
+            for (char *tok = strtok(optarg, ","); tok != NULL && numThreadCounts < MAX_THREADS;
+                 tok = strtok(NULL, ",")) {
+                int t = atoi(tok);
+                if (t >= 1 && t <= MAX_THREADS)
+                    threadCounts[numThreadCounts++] = t;
+            }
+            break;
+        case 's':
+            _scale = atof(optarg);
+            break;
+        case 'l':
+            library = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t 1,2,4,8] [-s scale] [-l ./MyMalloc.so] [benchmark ...]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    char *preload = realpath(library, NULL);
+    if (preload == NULL) {
+        perror(library);
+        return 1;
+    }
+
+    printf("%-14s %7s  %14s %10s  %14s %10s  %7s\n", "benchmark", "threads",
+           "libc ops/s", "RSS KB", "MyMalloc ops/s", "RSS KB", "ratio");
+    for (int i = 0; i < NUM_BENCHMARKS; i++) {
+        Benchmark *b = &_benchmarks[i];
+        int selected = optind == argc;
+        for (int a = optind; a < argc; a++)
+            selected |= strcmp(argv[a], b->_name) == 0;
+        if (!selected)
+            continue;
+        for (int t = 0; t < numThreadCounts; t++) {
+            RunResult libc = runChild(b->_name, threadCounts[t], NULL);
+            RunResult mine = runChild(b->_name, threadCounts[t], preload);
+            printf("%-14s %7d", b->_name, threadCounts[t]);
+            printResult(libc);
+            printResult(mine);
+            if (libc._ok && mine._ok)
+                printf("  %7.2f\n", mine._opsPerSec / libc._opsPerSec);
+            else
+                printf("  %7s\n", "-");
+            fflush(stdout);
+        }
+    }
+    free(preload);
+    return 0;
+}
@@ -0,0 +1,237 @@
+//
+// CS252: MyMalloc trace replayer
+//
+// Replays a trace recorded with MYMALLOC_TRACE against whichever allocator
+// this program runs with:
+//
+//   ./replay trace.bin                              (libc malloc)
+//   LD_PRELOAD=./MyMalloc.so ./replay trace.bin     (MyMalloc)
+//
+// The records of all threads are merged by timestamp and replayed on a
+// single thread. The replayer keeps its own data in mmap'd memory so that
+// only the replayed requests go through the allocator under test.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "MyMallocTrace.h"
+
+// Replayed object, indexed by the address recorded in the trace
+typedef struct LiveObject {
+    uint64_t _tracePtr;         // 0 if the slot is empty
+    void *_ptr;
+    size_t _size;
+} LiveObject;
+
+static LiveObject *_live;
+static size_t _liveMask;
+
+static void *mapMemory(size_t size) {
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return mem;
+}
+
+static size_t currentRSS() {
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0)
+        return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    unsigned long pages = 0, resident = 0;
+    sscanf(buf, "%lu %lu", &pages, &resident);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Stable bottom-up merge sort by timestamp. Records of one thread
+ * with equal timestamps keep their recorded order.
+ */
+static void sortRecords(TraceRecord *records, size_t n) {
+    TraceRecord *tmp = mapMemory(n * sizeof(TraceRecord));
+    TraceRecord *src = records, *dst = tmp;
+    for (size_t width = 1; width < n; width *= 2) {
+        for (size_t lo = 0; lo < n; lo += 2 * width) {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+            size_t i = lo, j = mid, k = lo;
+            while (i < mid && j < hi)
+                dst[k++] = src[j]._timestamp < src[i]._timestamp ? src[j++] : src[i++];
+            while (i < mid)
+                dst[k++] = src[i++];
+            while (j < hi)
+                dst[k++] = src[j++];
+        }
+        TraceRecord *t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != records)
+        memcpy(records, src, n * sizeof(TraceRecord));
+    munmap(tmp, n * sizeof(TraceRecord));
+}
+
+static LiveObject *findLive(uint64_t tracePtr) {
+    size_t i = (size_t) ((tracePtr >> 3) * 0x9E3779B97F4A7C15ULL) & _liveMask;
+    while (_live[i]._tracePtr != 0 && _live[i]._tracePtr != tracePtr)
+        i = (i + 1) & _liveMask;
+    return &_live[i];
+}
+
+static void removeLive(LiveObject *o) {
+    // backward-shift deletion so probes never stop at a hole
+    size_t hole = o - _live;
+    o->_tracePtr = 0;
+    for (size_t j = (hole + 1) & _liveMask; _live[j]._tracePtr != 0; j = (j + 1) & _liveMask) {
+        size_t home = (size_t) ((_live[j]._tracePtr >> 3) * 0x9E3779B97F4A7C15ULL) & _liveMask;
+        if (((j - home) & _liveMask) >= ((j - hole) & _liveMask)) {
+            _live[hole] = _live[j];
+            _live[j]._tracePtr = 0;
+            hole = j;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    if ((size_t) st.st_size < sizeof(TraceHeader)) {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        return 1;
+    }
+    char *file = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    close(fd);
+
+    TraceHeader *header = (TraceHeader *) file;
+    if (header->_magic != TRACE_MAGIC || header->_version != TRACE_VERSION ||
+        header->_recordSize != sizeof(TraceRecord)) {
+        fprintf(stderr, "%s: not a version %d trace file\n", argv[1], TRACE_VERSION);
+        return 1;
+    }
+    TraceRecord *records = (TraceRecord *) (file + sizeof(TraceHeader));
+    size_t n = (st.st_size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+    sortRecords(records, n);
+
+    size_t capacity = 1024;
+    while (capacity < 2 * n)
+        capacity *= 2;
+    _live = mapMemory(capacity * sizeof(LiveObject));
+    _liveMask = capacity - 1;
+
+    size_t counts[5] = { 0 };
+    size_t unmatched = 0, liveBytes = 0, peakLive = 0;
+    unsigned threads = 0;
+    size_t baselineRSS = currentRSS();
+    size_t peakRSS = baselineRSS;
+
+    double start = now();
+    for (size_t i = 0; i < n; i++) {
+        TraceRecord *r = &records[i];
+        if (r->_thread >= threads)
+            threads = r->_thread + 1;
+        if (r->_op < TRACE_MALLOC || r->_op > TRACE_CALLOC)
+            continue;
+        counts[r->_op]++;
+
+        void *oldPtr = NULL;
+        if (r->_op == TRACE_FREE || (r->_op == TRACE_REALLOC && r->_oldPtr != 0)) {
+            LiveObject *o = findLive(r->_op == TRACE_FREE ? r->_ptr : r->_oldPtr);
+            if (o->_tracePtr == 0) {
+                unmatched++;
+                continue;
+            }
+            oldPtr = o->_ptr;
+            liveBytes -= o->_size;
+            removeLive(o);
+        }
+
+        void *p = NULL;
+        switch (r->_op) {
+        case TRACE_MALLOC:
+            p = malloc(r->_size);
+            break;
+        case TRACE_CALLOC:
+            p = calloc(1, r->_size);
+            break;
+        case TRACE_REALLOC:
+            p = realloc(oldPtr, r->_size);
+            break;
+        case TRACE_FREE:
+            free(oldPtr);
+            break;
+        }
+
+        if (p != NULL && r->_ptr != 0) {
+            // touch the object like the traced program did
+            *(char *) p = 1;
+            LiveObject *o = findLive(r->_ptr);
+            if (o->_tracePtr != 0) {
+                // the free of this address was not recorded
+                free(o->_ptr);
+                liveBytes -= o->_size;
+                removeLive(o);
+                o = findLive(r->_ptr);
+            }
+            o->_tracePtr = r->_ptr;
+            o->_ptr = p;
+            o->_size = r->_size;
+            liveBytes += r->_size;
+            if (liveBytes > peakLive)
+                peakLive = liveBytes;
+        }
+
+        if ((i & 1023) == 0) {
+            size_t rss = currentRSS();
+            if (rss > peakRSS)
+                peakRSS = rss;
+        }
+    }
+    double elapsed = now() - start;
+    size_t rss = currentRSS();
+    if (rss > peakRSS)
+        peakRSS = rss;
+
+    printf("trace:          %s\n", argv[1]);
+    printf("threads:        %u\n", threads);
+    printf("ops:            %zu (malloc %zu, free %zu, realloc %zu, calloc %zu, unmatched %zu)\n",
+           n, counts[TRACE_MALLOC], counts[TRACE_FREE], counts[TRACE_REALLOC],
+           counts[TRACE_CALLOC], unmatched);
+    printf("time:           %.6f s (%.0f ops/s)\n", elapsed, elapsed > 0 ? n / elapsed : 0.0);
+    printf("peak live:      %zu bytes\n", peakLive);
+    printf("peak RSS:       %zu bytes (%zu before replay)\n", peakRSS, baselineRSS);
+    printf("fragmentation:  %.3f (RSS growth / peak live bytes)\n",
+           peakLive > 0 ? (double) (peakRSS - baselineRSS) / peakLive : 0.0);
+    return 0;
+}
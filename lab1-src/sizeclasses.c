@@ -0,0 +1,114 @@
+//
+// CS252: MyMalloc size class table generator
+//
+// Writes MyMallocSizeClasses.h to stdout:
+//
+//   ./sizeclasses > MyMallocSizeClasses.h
+//
+// Request sizes up to CLASS_MAX, the largest slab object, are spaced like
+// this:
+//
+//   8 .. 128 in steps of 8, 144 .. 256 in steps of 16,
+//   288 .. 512 in steps of 32, 576 .. 1024 in steps of 64
+//
+// and are mapped to their class with one load from a table indexed by
+// (size + 7) >> 3. Larger requests have no class; they come from the heap.
+// The generator checks the lookup against a plain search over the class
+// sizes before it writes anything.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CLASS_MAX 1024
+#define MAX_CLASSES 256
+
+#define PAGE_SIZE 4096
+#define MAX_SLAB_PAGES 64
+#define MIN_SLAB_OBJECTS 8
+
+static unsigned _classSize[MAX_CLASSES];
+static unsigned _classes;
+static unsigned char _classIndex[(CLASS_MAX >> 3) + 1];
+
+static unsigned lookup(size_t size) {
+    return _classIndex[(size + 7) >> 3];
+}
+
+/**
+ * @brief Picks the smallest slab, in pages, that holds at least
+ * MIN_SLAB_OBJECTS objects of size and wastes at most 1/8 of its bytes
+ */
+static unsigned slabPages(unsigned size) {
+    for (unsigned pages = 1; pages < MAX_SLAB_PAGES; pages++) {
+        size_t bytes = (size_t) pages * PAGE_SIZE;
+        size_t objects = bytes / size;
+        if (objects >= MIN_SLAB_OBJECTS && (bytes - objects * size) * 8 <= bytes)
+            return pages;
+    }
+    return MAX_SLAB_PAGES;
+}
+
+static void printTable(const char *declaration, const unsigned *values, unsigned n, unsigned perLine) {
+    printf(declaration, n);
+    printf(" = {");
+    for (unsigned i = 0; i < n; i++)
+        printf("%s%u%s", i % perLine == 0 ? "\n    " : " ", values[i], i < n - 1 ? "," : "");
+    printf("\n};\n\n");
+}
+
+int main() {
+    unsigned size = 0;
+    while (size < CLASS_MAX) {
+        unsigned step = size < 128 ? 8 : size < 256 ? 16 : size < 512 ? 32 : 64;
+        size += step;
+        _classSize[_classes++] = size;
+    }
+
+    unsigned c = 0;
+    for (unsigned i = 0; i <= CLASS_MAX >> 3; i++) {
+        while (_classSize[c] < i << 3)
+            c++;
+        _classIndex[i] = c;
+    }
+
+    // every size must map to the smallest class that holds it
+    for (size_t s = 1; s <= CLASS_MAX; s++) {
+        unsigned expected = 0;
+        while (_classSize[expected] < s)
+            expected++;
+        if (lookup(s) != expected) {
+            fprintf(stderr, "sizeclasses: size %zu maps to class %u instead of %u\n", s, lookup(s), expected);
+            return 1;
+        }
+    }
+
+    printf("//\n// CS252: MyMalloc size classes\n//\n");
+    printf("// Generated by sizeclasses.c. Do not edit.\n//\n\n");
+    printf("#ifndef MYMALLOC_SIZE_CLASSES_H\n#define MYMALLOC_SIZE_CLASSES_H\n\n");
+    printf("#define SIZE_CLASSES %u\n", _classes);
+    printf("#define SIZE_CLASS_MAX %u\n\n", CLASS_MAX);
+    printf("// The tables are constant expressions in C++, for PoolAllocator\n");
+    printf("#ifdef __cplusplus\n#define SIZE_CLASS_TABLE static constexpr\n");
+    printf("#else\n#define SIZE_CLASS_TABLE static const\n#endif\n\n");
+
+    unsigned values[MAX_CLASSES];
+    for (unsigned i = 0; i <= CLASS_MAX >> 3; i++)
+        values[i] = _classIndex[i];
+    printf("// Class of the sizes up to SIZE_CLASS_MAX, indexed by (size + 7) >> 3\n");
+    printTable("SIZE_CLASS_TABLE unsigned char _sizeClassIndex[%u]", values, (CLASS_MAX >> 3) + 1, 16);
+
+    printf("// Largest request size of each class\n");
+    printTable("SIZE_CLASS_TABLE unsigned int _classSize[%u]", _classSize, _classes, 8);
+
+    for (unsigned i = 0; i < _classes; i++)
+        values[i] = slabPages(_classSize[i]);
+    printf("// Pages per slab and objects per slab of each class\n");
+    printTable("SIZE_CLASS_TABLE unsigned short _classSlabPages[%u]", values, _classes, 8);
+    for (unsigned i = 0; i < _classes; i++)
+        values[i] = values[i] * PAGE_SIZE / _classSize[i];
+    printTable("SIZE_CLASS_TABLE unsigned short _classSlabObjects[%u]", values, _classes, 8);
+
+    printf("#endif\n");
+    return 0;
+}
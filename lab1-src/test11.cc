@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <thread>
+#include "MyMalloc.h"
+#include "MyMallocAllocator.h"
+
+// Containers over the C++ allocator adaptors. The output is the same in
+// every MYMALLOC_* mode.
+
+typedef std::pair<const int, int> Entry;
+typedef mymalloc::PoolAllocator<Entry> EntryAllocator;
+
+struct Big {
+  char bytes[40000];
+};
+
+// the class of a type is a compile time constant of the size class tables
+static_assert(mymalloc::PoolAllocator<char>::kObjectSize == 8, "char pool");
+static_assert(mymalloc::PoolAllocator<char[100]>::kObjectSize == _classSize[_sizeClassIndex[13]], "small pool");
+static_assert(mymalloc::PoolAllocator<char[1024]>::kObjectSize == 1024, "largest pool");
+static_assert(mymalloc::PoolAllocator<char[1500]>::kSizeClass == SIZE_CLASSES, "no class");
+static_assert(mymalloc::PoolAllocator<char[1500]>::kObjectSize == 1504, "rounded");
+static_assert(mymalloc::PoolAllocator<Big>::kSizeClass == SIZE_CLASSES, "no class");
+
+static void testMap() {
+  std::map<int, int, std::less<int>, mymalloc::PoolAllocator<Entry> > m;
+  for (int i = 0; i < 10000; i++)
+    m[i * 7 % 10000] = i;
+  long sum = 0;
+  for (auto &e : m)
+    sum += e.second;
+  for (int i = 0; i < 10000; i += 2)
+    m.erase(i);
+  printf("map: %zu entries, sum %ld\n", m.size(), sum);
+
+  // a pool block holds a whole block of the class
+  EntryAllocator allocator;
+  Entry *e = allocator.allocate(1);
+  printf("pool block fits the class: %s\n", sallocx(e, 0) >= EntryAllocator::kObjectSize ? "yes" : "no");
+  allocator.deallocate(e, 1);
+}
+
+typedef mymalloc::detail::Pool<EntryAllocator::kObjectSize> EntryPool;
+
+// freeing many objects at once leaves at most kHighWater blocks in the pool
+static void testPoolHighWater() {
+  static Entry *entries[10000];
+  EntryAllocator allocator;
+  for (int i = 0; i < 10000; i++)
+    entries[i] = allocator.allocate(1);
+  size_t most = 0;
+  for (int i = 0; i < 10000; i++) {
+    allocator.deallocate(entries[i], 1);
+    if (EntryPool::freeBlocks() > most)
+      most = EntryPool::freeBlocks();
+  }
+  printf("pool: free blocks kept below the high-water mark: %s\n", most <= EntryPool::kHighWater ? "yes" : "no");
+}
+
+// A thread-local that uses the pool allocator in its destructor, after the
+// pool of its thread is gone
+struct PoolUser {
+  ~PoolUser() {
+    EntryAllocator allocator;
+    Entry *e = allocator.allocate(1);
+    allocator.deallocate(e, 1);
+    usedAfterPool = EntryPool::freeBlocks() == 0;
+  }
+  static bool usedAfterPool;
+};
+
+bool PoolUser::usedAfterPool;
+
+static void usePoolAtExit() {
+  // constructed before the pool, so destroyed after it
+  static thread_local PoolUser user;
+  (void) user;
+  EntryAllocator allocator;
+  allocator.deallocate(allocator.allocate(1), 1);
+}
+
+static void testPmrList() {
+  Heap *heap = heap_create("test11");
+  mymalloc::HeapResource heapResource(heap);
+  {
+    std::pmr::list<std::pmr::string> l(&heapResource);
+    for (int i = 0; i < 1000; i++)
+      l.emplace_back(100, (char) ('a' + i % 26));
+    size_t length = 0;
+    for (auto &s : l)
+      length += s.size();
+    MallocStats stats;
+    heap_get_stats(heap, &stats);
+    printf("pmr list on a heap: %zu strings, %zu bytes, heap used: %s\n", l.size(), length,
+           stats._requestedBytes >= length ? "yes" : "no");
+  }
+  heap_destroy(heap);
+
+  Region *region = region_create();
+  mymalloc::RegionResource regionResource(region);
+  {
+    std::pmr::list<int> l(&regionResource);
+    for (int i = 0; i < 100000; i++)
+      l.push_back(i);
+    long sum = 0;
+    for (int i : l)
+      sum += i;
+    printf("pmr list on a region: %zu ints, sum %ld\n", l.size(), sum);
+  }
+  region_destroy(region);
+}
+
+static void testNew() {
+  // operator new comes from MyMalloc; aligned new goes to posix_memalign
+  struct alignas(64) Line {
+    char bytes[64];
+  };
+  Line *lines = new Line[10];
+  int *ints = new int[1000];
+  memset(ints, 0, 1000 * sizeof(int));
+  printf("new: aligned %s\n", ((size_t) lines & 63) == 0 ? "yes" : "no");
+  delete[] ints;
+  delete[] lines;
+}
+
+int main() {
+  printf("\n---- Running test11 ---\n");
+  // the pool of a thread goes back to the heap with free_batch when the
+  // thread exits
+  std::thread thread(testMap);
+  thread.join();
+  testMap();
+  testPoolHighWater();
+  std::thread poolUser(usePoolAtExit);
+  poolUser.join();
+  printf("pool: used by a thread-local destructor after it is gone: %s\n",
+         PoolUser::usedAfterPool ? "yes" : "no");
+  testPmrList();
+  testNew();
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "MyMalloc.h"
+
+// Counts the cache lines that hold live objects of two running threads,
+// which the threads would bounce between their caches when they write them.
+// Objects of mallocx(MALLOCX_CACHE_LINE) never share a line, and with
+// MYMALLOC_CACHE_LINES neither do those of malloc. The output is the same
+// in every MYMALLOC_* mode.
+
+#define THREADS 4
+#define OBJECTS 2000
+
+static void *objects[THREADS][OBJECTS];
+static size_t sizes[THREADS][OBJECTS];
+static int flags;
+static pthread_barrier_t barrier;
+
+static void *allocationThread(void *arg) {
+  long t = (long) arg;
+  unsigned random = t + 1;
+  pthread_barrier_wait(&barrier);
+  for (int i = 0; i < OBJECTS; i++) {
+    random = random * 1103515245 + 12345;
+    sizes[t][i] = (random >> 16) % 200 + 1;
+    objects[t][i] = flags ? mallocx(sizes[t][i], flags) : malloc(sizes[t][i]);
+    // free every third object so that the threads reuse each others' holes
+    if ((random >> 8) % 3 == 0 && i > 0) {
+      free(objects[t][i - 1]);
+      objects[t][i - 1] = NULL;
+    }
+  }
+  // a thread that exits leaves its pages to the threads still allocating
+  pthread_barrier_wait(&barrier);
+  return NULL;
+}
+
+struct Span {
+  uintptr_t first;
+  uintptr_t last;
+  long thread;
+};
+
+static int compareSpans(const void *a, const void *b) {
+  const struct Span *x = a, *y = b;
+  return x->first < y->first ? -1 : x->first > y->first;
+}
+
+static struct Span spans[THREADS * OBJECTS];
+
+// Runs the threads and returns the number of lines shared by two of them
+static int sharedLines(int withFlags, int *live) {
+  flags = withFlags;
+  pthread_barrier_init(&barrier, NULL, THREADS);
+  pthread_t threads[THREADS];
+  for (long t = 0; t < THREADS; t++)
+    pthread_create(&threads[t], NULL, allocationThread, (void *) t);
+  for (int t = 0; t < THREADS; t++)
+    pthread_join(threads[t], NULL);
+  pthread_barrier_destroy(&barrier);
+
+  int n = 0;
+  for (int t = 0; t < THREADS; t++) {
+    for (int i = 0; i < OBJECTS; i++) {
+      if (objects[t][i] == NULL)
+        continue;
+      spans[n].first = (uintptr_t) objects[t][i] / 64;
+      spans[n].last = ((uintptr_t) objects[t][i] + sizes[t][i] - 1) / 64;
+      spans[n].thread = t;
+      n++;
+    }
+  }
+  qsort(spans, n, sizeof(spans[0]), compareSpans);
+  int shared = 0;
+  for (int i = 1; i < n; i++)
+    if (spans[i].first <= spans[i - 1].last && spans[i].thread != spans[i - 1].thread)
+      shared++;
+
+  for (int t = 0; t < THREADS; t++)
+    for (int i = 0; i < OBJECTS; i++)
+      free(objects[t][i]);
+  *live = n;
+  return shared;
+}
+
+int main() {
+  printf("\n---- Running test12 ---\n");
+  free(malloc(1));
+
+  int live;
+  int shared = sharedLines(MALLOCX_CACHE_LINE, &live);
+  printf("mallocx: %d live objects, %d lines shared\n", live, shared);
+
+  // lines are shared by design in the other modes
+  shared = sharedLines(0, &live);
+  printf("malloc: %d live objects, %s\n", live,
+         getenv("MYMALLOC_CACHE_LINES") == NULL || shared == 0 ? "ok" : "lines shared");
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
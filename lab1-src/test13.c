@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "MyMalloc.h"
+
+// A SIGALRM handler that allocates and frees with every kind of call,
+// fired every 50 microseconds while the main program does the same. A
+// handler that interrupts the allocator must be served from the emergency
+// pool instead of waiting for a lock its own thread holds; on a shared
+// heap it fails or queues its free instead. The output is the same in
+// every MYMALLOC_* mode.
+
+#define KEEP 64
+#define SLOTS 256
+#define BATCH 8
+#define SHARED_PATH "test13.heap"
+
+static Heap *heap;
+static int heapFlags;
+static SharedHeap *sharedHeap;
+static volatile long handled;
+static volatile int corrupt;
+
+// Objects a handler leaves for the next one, each filled with its own byte
+static unsigned char *keep[KEEP];
+static size_t keepSize[KEEP];
+static unsigned char *keepShared[KEEP];
+
+static void fill(unsigned char *p, size_t size, int value) {
+  memset(p, value, size);
+}
+
+static void check(unsigned char *p, size_t size, int value) {
+  for (size_t i = 0; i < size; i++)
+    if (p[i] != (unsigned char) value)
+      corrupt = 1;
+}
+
+static void handler(int sig) {
+  long n = handled;
+  int i = n % KEEP;
+  if (keep[i] != NULL) {
+    check(keep[i], keepSize[i], i);
+    if (i & 1)
+      dallocx(keep[i], heapFlags);
+    else
+      free(keep[i]);
+  }
+
+  // malloc, realloc and calloc of the default heap
+  size_t size = 100 + n % 3000;
+  unsigned char *p = malloc(size);
+  if (p != NULL) {
+    fill(p, 100, 1);
+    unsigned char *q = realloc(p, 200);
+    if (q != NULL) {
+      check(q, 100, 1);
+      p = q;
+    }
+    free(p);
+  }
+  unsigned char *z = calloc(10, 10);
+  if (z != NULL) {
+    check(z, 100, 0);
+    free(z);
+  }
+
+  // the extended API on a named heap, and batches
+  keep[i] = NULL;
+  keepSize[i] = 16 + n % 500;
+  if (i & 1)
+    keep[i] = mallocx(keepSize[i], heapFlags);
+  else
+    keep[i] = malloc(keepSize[i]);
+  if (keep[i] != NULL) {
+    fill(keep[i], keepSize[i], i);
+    unsigned char *q = rallocx(keep[i], keepSize[i] + 16, (i & 1) ? heapFlags : 0);
+    if (q != NULL) {
+      keep[i] = q;
+      fill(keep[i] + keepSize[i], 16, i);
+      keepSize[i] += 16;
+    }
+  }
+  void *batch[BATCH];
+  size_t count = malloc_batch(48, BATCH, batch);
+  free_batch(batch, count);
+
+  void *s = signal_safe_malloc(64);
+  signal_safe_free(s);
+
+  // the shared heap may be locked by the code the handler interrupted
+  if (keepShared[i] != NULL) {
+    check(keepShared[i], 32, i);
+    shared_heap_free(sharedHeap, keepShared[i]);
+  }
+  keepShared[i] = shared_heap_malloc(sharedHeap, 32);
+  if (keepShared[i] != NULL)
+    fill(keepShared[i], 32, i);
+  handled = n + 1;
+}
+
+int main() {
+  printf("\n---- Running test13 ---\n");
+  heap = heap_create("test13");
+  heapFlags = MALLOCX_HEAP(heap_index(heap));
+  unlink(SHARED_PATH);
+  sharedHeap = shared_heap_open(SHARED_PATH, 1 << 20);
+  unsigned char *shared[SLOTS] = { 0 };
+
+  signal(SIGALRM, handler);
+  struct itimerval timer = { { 0, 50 }, { 0, 50 } };
+  setitimer(ITIMER_REAL, &timer, NULL);
+
+  unsigned char *p[SLOTS] = { 0 };
+  size_t sizes[SLOTS];
+  unsigned random = 1;
+  for (long i = 0; i < 1000000; i++) {
+    random = random * 1103515245 + 12345;
+    int k = (random >> 16) % SLOTS;
+    if (shared[k] != NULL) {
+      check(shared[k], 16, k);
+      shared_heap_free(sharedHeap, shared[k]);
+      shared[k] = NULL;
+    } else if (k & 1) {
+      shared[k] = shared_heap_malloc(sharedHeap, 16);
+      fill(shared[k], 16, k);
+    }
+    if (p[k] != NULL) {
+      check(p[k], sizes[k], k);
+      if (k % 3 == 0)
+        dallocx(p[k], heapFlags);
+      else if (k % 3 == 1)
+        free(p[k]);
+      else
+        free_batch((void **) &p[k], 1);
+      p[k] = NULL;
+      continue;
+    }
+    sizes[k] = (random >> 8) % 2000 + 1;
+    if (k % 3 == 0)
+      p[k] = mallocx(sizes[k], heapFlags);
+    else if (random & 1)
+      p[k] = malloc(sizes[k]);
+    else
+      p[k] = realloc(NULL, sizes[k]);
+    if (p[k] != NULL)
+      fill(p[k], sizes[k], k);
+  }
+
+  timer.it_value.tv_usec = timer.it_interval.tv_usec = 0;
+  setitimer(ITIMER_REAL, &timer, NULL);
+  for (int k = 0; k < SLOTS; k++) {
+    if (p[k] != NULL)
+      check(p[k], sizes[k], k);
+    if (k % 3 == 0)
+      dallocx(p[k], heapFlags);
+    else
+      free(p[k]);
+  }
+  for (int i = 0; i < KEEP; i++) {
+    if (keep[i] != NULL)
+      check(keep[i], keepSize[i], i);
+    if (i & 1)
+      dallocx(keep[i], heapFlags);
+    else
+      free(keep[i]);
+    if (keepShared[i] != NULL) {
+      check(keepShared[i], 32, i);
+      shared_heap_free(sharedHeap, keepShared[i]);
+    }
+  }
+  for (int k = 0; k < SLOTS; k++) {
+    if (shared[k] != NULL) {
+      check(shared[k], 16, k);
+      shared_heap_free(sharedHeap, shared[k]);
+    }
+  }
+
+  // the next free of each heap frees what the handlers queued
+  free(malloc(10));
+  heap_free(heap, heap_malloc(heap, 10));
+  shared_heap_free(sharedHeap, shared_heap_malloc(sharedHeap, 10));
+  MallocStats stats;
+  heap_get_stats(heap, &stats);
+  printf("handler ran: %s\n", handled > 0 ? "yes" : "no");
+  printf("objects intact: %s\n", corrupt ? "no" : "yes");
+  printf("named heap empty: %s\n", stats._requestedBytes == 0 ? "yes" : "no");
+  printf("shared heap empty: %s\n", sharedHeap->_requestedBytes == 0 ? "yes" : "no");
+  heap_destroy(heap);
+  shared_heap_close(sharedHeap);
+  unlink(SHARED_PATH);
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "MyMalloc.h"
+
+// malloc_batch and free_batch over sizes of several classes. Every object
+// is filled with its own byte and checked before it is freed. The output
+// is the same in every MYMALLOC_* mode.
+
+#define BATCH 100
+
+static int corrupt;
+
+static void check(unsigned char *p, size_t size, int value) {
+  for (size_t i = 0; i < size; i++)
+    if (p[i] != (unsigned char) value)
+      corrupt = 1;
+}
+
+static int compareAddresses(const void *a, const void *b) {
+  uintptr_t x = *(const uintptr_t *) a, y = *(const uintptr_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Whether the n objects of size bytes in ptrs overlap
+static int overlap(void **ptrs, size_t n, size_t size) {
+  void *sorted[BATCH];
+  memcpy(sorted, ptrs, n * sizeof(void *));
+  qsort(sorted, n, sizeof(void *), compareAddresses);
+  for (size_t i = 1; i < n; i++)
+    if ((char *) sorted[i - 1] + size > (char *) sorted[i])
+      return 1;
+  return 0;
+}
+
+static void testBatch() {
+  static const size_t sizes[] = { 8, 24, 100, 1000, 3000, 20000 };
+  const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+  void *ptrs[nsizes * BATCH];
+  size_t counts = 0;
+  int overlaps = 0;
+  for (int round = 0; round < 20; round++) {
+    size_t n = 0;
+    for (int s = 0; s < nsizes; s++) {
+      size_t count = malloc_batch(sizes[s], BATCH, ptrs + n);
+      if (count == BATCH)
+        counts++;
+      overlaps |= overlap(ptrs + n, count, sizes[s]);
+      for (size_t i = 0; i < count; i++)
+        memset(ptrs[n + i], s + 1, sizes[s]);
+      n += count;
+    }
+    for (size_t i = 0; i < n; i++)
+      check(ptrs[i], 8, i / BATCH + 1);
+    // free in an order that mixes the sizes and their classes
+    for (size_t i = 0; i < n; i += 3) {
+      void *t = ptrs[i];
+      ptrs[i] = ptrs[n - 1 - i];
+      ptrs[n - 1 - i] = t;
+    }
+    ptrs[n / 2] = NULL;
+    free_batch(ptrs, n);
+  }
+  printf("batch: all batches full: %s, no overlap: %s\n", counts == 20 * nsizes ? "yes" : "no",
+         overlaps ? "no" : "yes");
+}
+
+int main() {
+  printf("\n---- Running test14 ---\n");
+  testBatch();
+  printf("objects intact: %s\n", corrupt ? "no" : "yes");
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include "MyMalloc.h"
+
+// The extended API: mallocx, rallocx, xallocx, sallocx, nallocx and
+// dallocx on the default heap, without the thread cache and on a named
+// heap. The output is the same in every MYMALLOC_* mode.
+
+static int failed;
+
+#define CHECK(c) do { if (!(c)) { printf("failed: %s (line %d)\n", #c, __LINE__); failed = 1; } } while (0)
+
+static int isFilled(unsigned char *p, size_t size, int value) {
+  for (size_t i = 0; i < size; i++)
+    if (p[i] != (unsigned char) value)
+      return 0;
+  return 1;
+}
+
+// mallocx, rallocx, xallocx, sallocx, nallocx and dallocx with flags on
+// the default heap, without the thread cache, and on a named heap
+static void testFlags(const char *name, int flags) {
+  unsigned char *p = mallocx(100, flags | MALLOCX_ZERO);
+  CHECK(p != NULL && isFilled(p, 100, 0));
+  CHECK(sallocx(p, flags) >= 100);
+  CHECK(sallocx(p, flags) >= nallocx(100, flags));
+  memset(p, 7, 100);
+
+  unsigned char *aligned = mallocx(50, flags | MALLOCX_ALIGN(256));
+  CHECK(aligned != NULL && ((uintptr_t) aligned & 255) == 0);
+  unsigned char *line = mallocx(10, flags | MALLOCX_CACHE_LINE);
+  CHECK(line != NULL && ((uintptr_t) line & 63) == 0 && sallocx(line, flags) >= 64);
+
+  // shrinking in place always works; growing may not
+  unsigned char *big = mallocx(5000, flags);
+  memset(big, 1, 5000);
+  size_t usable = xallocx(big, 3000, 0, flags);
+  CHECK(usable >= 3000 && usable < 5000 && isFilled(big, 3000, 1));
+  usable = xallocx(big, 6000, 2000, flags | MALLOCX_ZERO);
+  CHECK(usable >= 3000 && isFilled(big, 3000, 1));
+  if (usable > 5000)
+    CHECK(isFilled(big + 5000, usable - 5000, 0));
+
+  // the zeroed bytes start after the usable size of the old object
+  size_t oldUsable = sallocx(p, flags);
+  unsigned char *r = rallocx(p, 100000, flags | MALLOCX_ZERO);
+  CHECK(r != NULL && isFilled(r, 100, 7) && isFilled(r + oldUsable, 100000 - oldUsable, 0));
+  r = rallocx(r, 10, flags);
+  CHECK(r != NULL && isFilled(r, 10, 7));
+  dallocx(r, flags);
+  dallocx(aligned, flags);
+  dallocx(line, flags);
+  dallocx(big, flags);
+
+  // resize objects at random, checking their bytes each time
+  static unsigned char *objects[1000];
+  static size_t sizes[1000];
+  int corrupt = 0;
+  unsigned long long random = 1;
+  for (int i = 0; i < 100000; i++) {
+    random = random * 6364136223846793005ULL + 1;
+    int k = (random >> 33) % 1000;
+    size_t size = (random >> 20) % 3000 + 1;
+    if (objects[k] == NULL) {
+      objects[k] = mallocx(size, flags);
+      sizes[k] = size;
+      memset(objects[k], k, size);
+      continue;
+    }
+    corrupt |= !isFilled(objects[k], sizes[k], k);
+    switch ((random >> 50) % 3) {
+    case 0:
+      dallocx(objects[k], flags);
+      objects[k] = NULL;
+      break;
+    case 1:
+      usable = xallocx(objects[k], size, 64, flags);
+      if (usable >= size) {
+        memset(objects[k], k, size);
+        sizes[k] = size;
+      } else if (usable < sizes[k]) {
+        sizes[k] = usable;
+      }
+      break;
+    case 2:
+      objects[k] = rallocx(objects[k], size, flags);
+      memset(objects[k], k, size);
+      sizes[k] = size;
+      break;
+    }
+  }
+  for (int k = 0; k < 1000; k++) {
+    if (objects[k] != NULL) {
+      corrupt |= !isFilled(objects[k], sizes[k], k);
+      dallocx(objects[k], flags);
+      objects[k] = NULL;
+    }
+  }
+  printf("%s: objects intact: %s\n", name, corrupt ? "no" : "yes");
+}
+
+int main() {
+  printf("\n---- Running test15 ---\n");
+  testFlags("default heap", 0);
+  testFlags("no thread cache", MALLOCX_TCACHE_NONE);
+  Heap *heap = heap_create("test15");
+  testFlags("named heap", MALLOCX_HEAP(heap_index(heap)));
+  MallocStats stats;
+  heap_get_stats(heap, &stats);
+  printf("named heap empty: %s\n", stats._requestedBytes == 0 ? "yes" : "no");
+  heap_destroy(heap);
+
+  printf("mallocx of an unknown heap: %s\n",
+         mallocx(10, MALLOCX_HEAP(MALLOCX_HEAPS - 1)) == NULL && errno == EINVAL ? "EINVAL" : "no error");
+  printf("checks: %s\n", failed ? "failed" : "passed");
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "MyMalloc.h"
+
+// A shared heap between two processes: the child finds an object the
+// parent left, frees it and leaves its own. The heap then has to fill up
+// without growing and be empty after the frees. The output is the same in
+// every MYMALLOC_* mode.
+
+#define SHARED_PATH "test16.heap"
+#define HEAP_SIZE (1 << 20)
+
+static void testSharedHeap() {
+  unlink(SHARED_PATH);
+  SharedHeap *heap = shared_heap_open(SHARED_PATH, HEAP_SIZE);
+  if (heap == NULL) {
+    printf("shared heap: open failed\n");
+    return;
+  }
+  char *message = shared_heap_malloc(heap, 100);
+  strcpy(message, "from the parent");
+  heap->_root = shared_heap_offset(heap, message);
+
+  // the child finds the parent's object, frees it and leaves its own
+  pid_t pid = fork();
+  if (pid == 0) {
+    SharedHeap *child = shared_heap_open(SHARED_PATH, 0);
+    if (child == NULL)
+      _exit(1);
+    char *received = shared_heap_pointer(child, child->_root);
+    int ok = strcmp(received, "from the parent") == 0;
+    shared_heap_free(child, received);
+    char *reply = shared_heap_malloc(child, 200);
+    strcpy(reply, "from the child");
+    child->_root = shared_heap_offset(child, reply);
+    shared_heap_close(child);
+    _exit(ok ? 0 : 2);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  char *reply = shared_heap_pointer(heap, heap->_root);
+  printf("shared heap: child saw the object: %s, parent sees the reply: %s\n",
+         WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "yes" : "no",
+         strcmp(reply, "from the child") == 0 ? "yes" : "no");
+
+  // fill the heap; it never grows
+  size_t count = 0;
+  void *objects[HEAP_SIZE / 1000];
+  while ((objects[count] = shared_heap_malloc(heap, 1000)) != NULL)
+    count++;
+  int full = errno == ENOMEM && count > HEAP_SIZE / 1100;
+  for (size_t i = 0; i < count; i++)
+    shared_heap_free(heap, objects[i]);
+  shared_heap_free(heap, reply);
+  printf("shared heap: fills up with ENOMEM: %s, empty after the frees: %s\n", full ? "yes" : "no",
+         heap->_requestedBytes == 0 && heap->_allocatedBytes == 0 ? "yes" : "no");
+  shared_heap_close(heap);
+  unlink(SHARED_PATH);
+}
+
+int main() {
+  printf("\n---- Running test16 ---\n");
+  testSharedHeap();
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
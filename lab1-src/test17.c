@@ -0,0 +1,63 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "MyMalloc.h"
+
+// 600 short-lived threads: each round a producer allocates objects and
+// exits, and a consumer frees them all from another thread. The memory of
+// the threads that are gone has to be reused rather than piling up. The
+// output is the same in every MYMALLOC_* mode.
+
+#define ROUNDS 300
+#define OBJECTS 20000
+
+static unsigned char *objects[OBJECTS];
+static int corrupt;
+
+static void *producer(void *arg) {
+  for (int i = 0; i < OBJECTS; i++) {
+    size_t size = 8 + (i % 16) * 8;
+    objects[i] = malloc(size);
+    memset(objects[i], i & 0xff, size);
+  }
+  return NULL;
+}
+
+static void *consumer(void *arg) {
+  for (int i = 0; i < OBJECTS; i++) {
+    size_t size = 8 + (i % 16) * 8;
+    for (size_t k = 0; k < size; k++)
+      if (objects[i][k] != (unsigned char) (i & 0xff))
+        corrupt = 1;
+    free(objects[i]);
+  }
+  return NULL;
+}
+
+int main() {
+  printf("\n---- Running test17 ---\n");
+  size_t firstHeapSize = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, producer, NULL);
+    pthread_join(thread, NULL);
+    pthread_create(&thread, NULL, consumer, NULL);
+    pthread_join(thread, NULL);
+    if (round == 0) {
+      MallocStats stats;
+      get_malloc_stats(&stats);
+      firstHeapSize = stats._heapSize;
+    }
+  }
+  MallocStats stats;
+  get_malloc_stats(&stats);
+  printf("%d threads: objects intact: %s\n", 2 * ROUNDS, corrupt ? "no" : "yes");
+  printf("%d threads: heap no larger than after the first round: %s\n", 2 * ROUNDS,
+         stats._heapSize <= firstHeapSize ? "yes" : "no");
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
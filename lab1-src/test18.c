@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "MyMalloc.h"
+
+// Named heaps created, filled and destroyed over and over while the
+// default heap hands chunks back to the chunk cache. Every destroyed heap
+// has to give all its chunks back: the heap size stays the same from round
+// to round, and the resident set grows by less than a single 2MB chunk
+// over all of them. The output is the same in every MYMALLOC_* mode.
+
+#define ROUNDS 200
+#define WARMUP 10
+#define OBJECTS 3000
+
+// Resident bytes of the process, from /proc/self/statm
+static size_t resident() {
+  char buf[128];
+  int fd = open("/proc/self/statm", O_RDONLY);
+  if (fd < 0)
+    return 0;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+  unsigned long pages = 0, pagesResident = 0;
+  sscanf(buf, "%lu %lu", &pages, &pagesResident);
+  return pagesResident * sysconf(_SC_PAGESIZE);
+}
+
+int main() {
+  printf("\n---- Running test18 ---\n");
+  size_t firstHeapSize = 0, firstResident = 0;
+  int corrupt = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    // empty chunks of the default heap go to the chunk cache
+    void *big[8];
+    for (int i = 0; i < 8; i++) {
+      big[i] = malloc(1000000);
+      memset(big[i], i, 1000000);
+    }
+    for (int i = 0; i < 8; i++)
+      free(big[i]);
+
+    Heap *heap = heap_create("test18");
+    static unsigned char *objects[OBJECTS];
+    for (int i = 0; i < OBJECTS; i++) {
+      objects[i] = heap_malloc(heap, 1000);
+      memset(objects[i], i & 0xff, 1000);
+    }
+    for (int i = 0; i < OBJECTS; i += 7)
+      corrupt |= objects[i][999] != (unsigned char) (i & 0xff);
+    heap_destroy(heap);
+
+    // the chunk cache and the thread caches fill up in the first rounds
+    if (round == WARMUP) {
+      firstHeapSize = _heapSize;
+      firstResident = resident();
+    }
+  }
+  size_t heapSize = _heapSize, lastResident = resident();
+  printf("%d heaps: objects intact: %s\n", ROUNDS, corrupt ? "no" : "yes");
+  printf("%d heaps: heap size unchanged after warming up: %s\n", ROUNDS,
+         heapSize == firstHeapSize ? "yes" : "no");
+  printf("%d heaps: resident set flat after warming up: %s\n", ROUNDS,
+         lastResident < firstResident + (2 << 20) ? "yes" : "no");
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+#include "MyMalloc.h"
+
+// The heap profiler, sampling every allocation. Each site below allocates
+// through a different entry point and frees every other object. In the
+// heap_v2 dump the stack of its samples has to start in the site itself,
+// and its bucket has to count the objects and bytes it allocated and still
+// holds. The output is the same in every MYMALLOC_* mode.
+
+#define PROFILE_PATH "test19.prof"
+#define OBJECTS 100
+#define SITES 5
+#define SITE_BYTES 256          // more than the code of a site
+
+static void *objects[SITES][OBJECTS];
+
+static __attribute__((noinline)) void siteMalloc(int i, size_t size) {
+  objects[0][i] = malloc(size);
+}
+
+static __attribute__((noinline)) void siteCalloc(int i, size_t size) {
+  objects[1][i] = calloc(1, size);
+}
+
+static __attribute__((noinline)) void siteRealloc(int i, size_t size) {
+  objects[2][i] = realloc(NULL, size);
+}
+
+static __attribute__((noinline)) void siteMemalign(int i, size_t size) {
+  objects[3][i] = memalign(64, size);
+}
+
+static __attribute__((noinline)) void siteMallocx(int i, size_t size) {
+  objects[4][i] = mallocx(size, 0);
+}
+
+static void (*const sites[SITES])(int, size_t) = {
+  siteMalloc, siteCalloc, siteRealloc, siteMemalign, siteMallocx
+};
+static const char *const siteNames[SITES] = { "malloc", "calloc", "realloc", "memalign", "mallocx" };
+
+// The site whose code holds the return address pc, -1 if none
+static int siteOf(void *pc) {
+  int site = -1;
+  for (int s = 0; s < SITES; s++) {
+    char *start = (char *) sites[s];
+    if ((char *) pc >= start && (char *) pc < start + SITE_BYTES &&
+        (site < 0 || start > (char *) sites[site]))
+      site = s;
+  }
+  return site;
+}
+
+int main(int argc, char **argv) {
+  // the profiler is set up from the environment when the allocator starts
+  if (getenv("MYMALLOC_PROF") == NULL) {
+    setenv("MYMALLOC_PROF", PROFILE_PATH, 1);
+    setenv("MYMALLOC_PROF_SAMPLE", "1", 1);
+    execv("/proc/self/exe", argv);
+    printf("exec failed\n");
+    return 1;
+  }
+  printf("\n---- Running test19 ---\n");
+
+  for (int s = 0; s < SITES; s++) {
+    for (int i = 0; i < OBJECTS; i++)
+      sites[s](i, 100 + i);
+    for (int i = 0; i < OBJECTS; i += 2)
+      free(objects[s][i]);
+  }
+  if (heap_profile_dump(PROFILE_PATH) != 0) {
+    printf("dump failed\n");
+    return 1;
+  }
+
+  FILE *f = fopen(PROFILE_PATH, "r");
+  char line[1024];
+  size_t rate = 0, totalLive = 0, headerLive = 0;
+  if (fgets(line, sizeof(line), f) != NULL)
+    sscanf(line, "heap profile: %zu: %*u [%*u: %*u] @ heap_v2/%zu", &headerLive, &rate);
+  printf("profile: heap_v2, one sample per byte: %s\n", rate == 1 ? "yes" : "no");
+
+  // the buckets come in hash order
+  int found[SITES] = { 0 };
+  size_t counts[SITES][4];
+  while (fgets(line, sizeof(line), f) != NULL && line[0] != '\n') {
+    size_t live, liveBytes, allocs, allocBytes;
+    void *top = NULL;
+    if (sscanf(line, "%zu: %zu [%zu: %zu] @ %p", &live, &liveBytes, &allocs, &allocBytes, &top) != 5)
+      continue;
+    totalLive += live;
+    int s = siteOf(top);
+    if (s < 0)
+      continue;
+    found[s]++;
+    counts[s][0] = live;
+    counts[s][1] = liveBytes;
+    counts[s][2] = allocs;
+    counts[s][3] = allocBytes;
+  }
+  fclose(f);
+  for (int s = 0; s < SITES; s++) {
+    printf("%s: buckets starting in the site: %d\n", siteNames[s], found[s]);
+    if (found[s] == 1)
+      printf("%s: live %zu objects %zu bytes, allocated %zu objects %zu bytes\n", siteNames[s],
+             counts[s][0], counts[s][1], counts[s][2], counts[s][3]);
+  }
+  printf("profile: header counts the live samples of the buckets: %s\n",
+         headerLive == totalLive ? "yes" : "no");
+  unlink(PROFILE_PATH);
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
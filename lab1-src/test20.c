@@ -0,0 +1,56 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "MyMalloc.h"
+
+// Regions: objects of many sizes and one larger than a chunk, reset and
+// reused three times. Every object is filled with its own byte and checked
+// before the reset. The output is the same in every MYMALLOC_* mode.
+
+static int corrupt;
+
+static void check(unsigned char *p, size_t size, int value) {
+  for (size_t i = 0; i < size; i++)
+    if (p[i] != (unsigned char) value)
+      corrupt = 1;
+}
+
+static void testRegions() {
+  MallocStats before, after;
+  get_malloc_stats(&before);
+
+  Region *region = region_create();
+  int aligned = 1;
+  for (int round = 0; round < 3; round++) {
+    unsigned char *objects[1000];
+    for (int i = 0; i < 1000; i++) {
+      objects[i] = region_alloc(region, i % 200 + 1);
+      aligned &= ((uintptr_t) objects[i] & 7) == 0;
+      memset(objects[i], i & 0xff, i % 200 + 1);
+    }
+    // larger than a chunk
+    unsigned char *big = region_alloc(region, 500000);
+    memset(big, 0xab, 500000);
+    for (int i = 0; i < 1000; i++)
+      check(objects[i], i % 200 + 1, i & 0xff);
+    check(big, 500000, 0xab);
+    region_reset(region);
+  }
+  region_destroy(region);
+
+  get_malloc_stats(&after);
+  printf("regions: aligned: %s, memory back in the heap: %s\n", aligned ? "yes" : "no",
+         after._allocatedBytes == before._allocatedBytes ? "yes" : "no");
+}
+
+int main() {
+  printf("\n---- Running test20 ---\n");
+  testRegions();
+  printf("objects intact: %s\n", corrupt ? "no" : "yes");
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
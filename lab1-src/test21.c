@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "MyMalloc.h"
+
+// Two named heaps: one keeps 10000 objects of random sizes and alignments
+// while the other churns alongside. The stats of each heap must only count
+// its own objects, and destroying a heap frees what is left in it. The
+// output is the same in every MYMALLOC_* mode.
+
+static int corrupt;
+
+static void check(unsigned char *p, size_t size, int value) {
+  for (size_t i = 0; i < size; i++)
+    if (p[i] != (unsigned char) value)
+      corrupt = 1;
+}
+
+static void testNamedHeaps() {
+  Heap *heap = heap_create("test21");
+  Heap *other = heap_create("test21-other");
+  printf("named heaps: indexes %d %d\n", heap_index(heap), heap_index(other));
+
+  static unsigned char *objects[10000];
+  static size_t sizes[10000];
+  size_t live = 0;
+  int aligned = 1;
+  unsigned random = 1;
+  for (int i = 0; i < 10000; i++) {
+    random = random * 1103515245 + 12345;
+    sizes[i] = (random >> 16) % 5000 + 1;
+    if (i % 10 == 0) {
+      size_t alignment = (size_t) 16 << (i / 10 % 8);
+      objects[i] = heap_memalign(heap, alignment, sizes[i]);
+      aligned &= ((uintptr_t) objects[i] & (alignment - 1)) == 0;
+    } else {
+      objects[i] = heap_malloc(heap, sizes[i]);
+    }
+    memset(objects[i], i & 0xff, sizes[i]);
+    live += sizes[i];
+    // the other heap churns alongside
+    heap_free(other, heap_malloc(other, sizes[i]));
+  }
+  for (int i = 0; i < 10000; i += 2) {
+    check(objects[i], sizes[i], i & 0xff);
+    heap_free(heap, objects[i]);
+    live -= sizes[i];
+  }
+  MallocStats stats;
+  heap_get_stats(heap, &stats);
+  printf("named heaps: aligned: %s, requested bytes match: %s\n", aligned ? "yes" : "no",
+         stats._requestedBytes == live ? "yes" : "no");
+
+  for (int i = 1; i < 10000; i += 2) {
+    check(objects[i], sizes[i], i & 0xff);
+    heap_free(heap, objects[i]);
+  }
+  heap_get_stats(heap, &stats);
+  printf("named heaps: empty after the frees: %s\n",
+         stats._requestedBytes == 0 && stats._allocatedBytes == 0 ? "yes" : "no");
+  heap_get_stats(other, &stats);
+  printf("named heaps: other heap empty: %s\n", stats._requestedBytes == 0 ? "yes" : "no");
+
+  // destroying a heap releases the objects still in it
+  for (int i = 0; i < 1000; i++)
+    heap_malloc(heap, 1000);
+  heap_destroy(heap);
+  heap_destroy(other);
+  // the freed indexes are handed out again
+  heap = heap_create("test21-again");
+  printf("named heaps: index reused: %s\n", heap_index(heap) == 0 ? "yes" : "no");
+  heap_destroy(heap);
+}
+
+int main() {
+  printf("\n---- Running test21 ---\n");
+  testNamedHeaps();
+  printf("objects intact: %s\n", corrupt ? "no" : "yes");
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "MyMalloc.h"
+
+// A persistent heap kept across opens: a list built with plain pointers
+// has to be found again at the same address, a heap left open is checked
+// and accepted, and a damaged one is rejected. The output is the same in
+// every MYMALLOC_* mode.
+
+#define PERSISTENT_PATH "test22.heap"
+#define HEAP_SIZE (1 << 20)
+
+typedef struct Node {
+  struct Node *_next;
+  int _value;
+} Node;
+
+static void testPersistentHeap() {
+  unlink(PERSISTENT_PATH);
+  SharedHeap *heap = persistent_heap_open(PERSISTENT_PATH, HEAP_SIZE, NULL);
+  if (heap == NULL) {
+    printf("persistent heap: open failed\n");
+    return;
+  }
+  void *base = heap;
+  // a list with plain pointers, rooted in the heap
+  Node *list = NULL;
+  for (int i = 0; i < 1000; i++) {
+    Node *node = shared_heap_malloc(heap, sizeof(Node));
+    node->_next = list;
+    node->_value = i;
+    list = node;
+  }
+  heap->_root = shared_heap_offset(heap, list);
+
+  SharedHeap *again = persistent_heap_open(PERSISTENT_PATH, HEAP_SIZE, NULL);
+  printf("persistent heap: second open busy: %s\n", again == NULL && errno == EBUSY ? "yes" : "no");
+  persistent_heap_close(heap);
+
+  heap = persistent_heap_open(PERSISTENT_PATH, 0, NULL);
+  int sum = 0;
+  for (Node *node = shared_heap_pointer(heap, heap->_root); node != NULL; node = node->_next)
+    sum += node->_value;
+  printf("persistent heap: same address: %s, list sum %d\n", (void *) heap == base ? "yes" : "no", sum);
+
+  // a heap left without persistent_heap_close is checked when reopened
+  Node *first = shared_heap_pointer(heap, heap->_root);
+  shared_heap_close(heap);
+  heap = persistent_heap_open(PERSISTENT_PATH, 0, NULL);
+  printf("persistent heap: unclean heap checked and accepted: %s\n", heap != NULL ? "yes" : "no");
+  if (heap == NULL)
+    return;
+  // damage the boundary tag of the first node
+  memset((char *) first - sizeof(SharedBoundaryTag), 0xff, sizeof(size_t));
+  shared_heap_close(heap);
+  heap = persistent_heap_open(PERSISTENT_PATH, 0, NULL);
+  printf("persistent heap: damaged heap rejected: %s\n", heap == NULL && errno == EINVAL ? "yes" : "no");
+  unlink(PERSISTENT_PATH);
+}
+
+int main() {
+  printf("\n---- Running test22 ---\n");
+  testPersistentHeap();
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
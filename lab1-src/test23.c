@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include "MyMalloc.h"
+
+// The emergency pool outside a handler: it has to run out with ENOMEM,
+// hand its blocks out again after they are freed with either call, and
+// refuse requests above its largest class. The output is the same in every
+// MYMALLOC_* mode.
+
+static int isFilled(unsigned char *p, size_t size, int value) {
+  for (size_t i = 0; i < size; i++)
+    if (p[i] != (unsigned char) value)
+      return 0;
+  return 1;
+}
+
+static void testEmergencyPool() {
+  // the pool serves handlers, but its calls work anywhere
+  static void *blocks[EMERGENCY_POOL_SIZE / 64];
+  size_t n = 0;
+  int aligned = 1;
+  while ((blocks[n] = signal_safe_malloc(100)) != NULL) {
+    aligned &= ((uintptr_t) blocks[n] & 15) == 0;
+    memset(blocks[n], n & 0xff, 100);
+    n++;
+  }
+  int exhausted = errno == ENOMEM;
+  int intact = 1;
+  for (size_t i = 0; i < n; i++) {
+    intact &= isFilled(blocks[i], 100, i & 0xff);
+    // pool objects may be freed with free() as well
+    if (i & 1)
+      free(blocks[i]);
+    else
+      signal_safe_free(blocks[i]);
+  }
+  size_t again = 0;
+  while ((blocks[again] = signal_safe_malloc(100)) != NULL)
+    again++;
+  printf("emergency pool: aligned: %s, exhausted with ENOMEM: %s, intact: %s, blocks reused: %s\n",
+         aligned ? "yes" : "no", exhausted ? "yes" : "no", intact ? "yes" : "no", again == n ? "yes" : "no");
+
+  // realloc() outside a handler moves a pool object to the heap
+  memset(blocks[0], 9, 100);
+  unsigned char *moved = realloc(blocks[0], 1000);
+  printf("emergency pool: realloc moves to the heap: %s\n",
+         moved != NULL && isFilled(moved, 100, 9) && signal_safe_malloc(100) == blocks[0] ? "yes" : "no");
+  free(moved);
+  for (size_t i = 1; i < again; i++)
+    free(blocks[i]);
+  free(blocks[0]);
+
+  // requests above the largest class are refused
+  printf("emergency pool: large request refused: %s\n",
+         signal_safe_malloc((size_t) EMERGENCY_BLOCK_MIN << EMERGENCY_CLASSES) == NULL ? "yes" : "no");
+}
+
+int main() {
+  printf("\n---- Running test23 ---\n");
+  testEmergencyPool();
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
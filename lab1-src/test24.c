@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "MyMalloc.h"
+
+// 8 threads that each allocate small objects and then free the ones
+// another thread allocated, so that full magazines keep moving through the
+// class depots. No object may be handed to two threads at once, and the
+// heap must stop growing once the caches are warm. The output is the same
+// in every MYMALLOC_* mode.
+
+#define THREADS 8
+#define ROUNDS 100
+#define WARMUP 10
+#define OBJECTS 1000
+
+static unsigned char *objects[THREADS][OBJECTS];
+static pthread_barrier_t barrier;
+static int corrupt;
+static int overlaps;
+static size_t warmHeapSize;
+
+static size_t sizeOf(int i) {
+  return 8 + (i % 64) * 16;
+}
+
+static int compareAddresses(const void *a, const void *b) {
+  uintptr_t x = *(const uintptr_t *) a, y = *(const uintptr_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Whether any of the live objects of all the threads overlap
+static int overlap() {
+  static unsigned char *sorted[THREADS * OBJECTS];
+  memcpy(sorted, objects, sizeof(sorted));
+  qsort(sorted, THREADS * OBJECTS, sizeof(sorted[0]), compareAddresses);
+  for (int i = 1; i < THREADS * OBJECTS; i++)
+    if (sorted[i - 1] + 8 > sorted[i])
+      return 1;
+  return 0;
+}
+
+static void *run(void *arg) {
+  int t = (int) (intptr_t) arg;
+  int from = (t + 1) % THREADS;
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < OBJECTS; i++) {
+      objects[t][i] = malloc(sizeOf(i));
+      memset(objects[t][i], (t + i) & 0xff, sizeOf(i));
+    }
+    if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+      overlaps |= overlap();
+      if (round == WARMUP) {
+        MallocStats stats;
+        get_malloc_stats(&stats);
+        warmHeapSize = stats._heapSize;
+      }
+    }
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < OBJECTS; i++) {
+      for (size_t k = 0; k < sizeOf(i); k++)
+        if (objects[from][i][k] != (unsigned char) ((from + i) & 0xff))
+          corrupt = 1;
+      free(objects[from][i]);
+    }
+    pthread_barrier_wait(&barrier);
+  }
+  return NULL;
+}
+
+int main() {
+  printf("\n---- Running test24 ---\n");
+  pthread_barrier_init(&barrier, NULL, THREADS);
+  pthread_t threads[THREADS];
+  for (int t = 0; t < THREADS; t++)
+    pthread_create(&threads[t], NULL, run, (void *) (intptr_t) t);
+  for (int t = 0; t < THREADS; t++)
+    pthread_join(threads[t], NULL);
+
+  MallocStats stats;
+  get_malloc_stats(&stats);
+  printf("%d threads: objects intact: %s\n", THREADS, corrupt ? "no" : "yes");
+  printf("%d threads: no object handed out twice: %s\n", THREADS, overlaps ? "no" : "yes");
+  printf("%d threads: heap no larger than after the warm-up: %s\n", THREADS,
+         stats._heapSize <= warmHeapSize ? "yes" : "no");
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
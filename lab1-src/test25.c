@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "MyMalloc.h"
+
+// The allocation trace. Two threads, one after the other, allocate with
+// malloc and calloc, resize with realloc and free everything. The trace is
+// then replayed with ./replay against MyMalloc.so: the replayer has to see
+// both threads, every call, and match every free and realloc to an object
+// it allocated. The C library may allocate for itself, so the counts are
+// lower bounds. The output is the same in every MYMALLOC_* mode.
+
+#define TRACE_PATH "test25.trace"
+#define MALLOCS 1000
+#define CALLOCS 200
+#define REALLOCS 300
+
+static void *run(void *arg) {
+  static __thread void *objects[MALLOCS + CALLOCS];
+  for (int i = 0; i < MALLOCS; i++)
+    objects[i] = malloc(16 + i % 500);
+  for (int i = 0; i < CALLOCS; i++)
+    objects[MALLOCS + i] = calloc(1, 16 + i);
+  for (int i = 0; i < REALLOCS; i++)
+    objects[i * 3] = realloc(objects[i * 3], 600 + i * 10);
+  for (int i = 0; i < MALLOCS + CALLOCS; i++)
+    free(objects[i]);
+  return NULL;
+}
+
+// Runs ./replay on the trace and reads its report into buf, without
+// allocating so that nothing more is traced
+static int replay(char *buf, size_t size) {
+  int fds[2];
+  if (pipe(fds) != 0)
+    return -1;
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(fds[1], 1);
+    close(fds[0]);
+    unsetenv("MYMALLOC_TRACE");
+    setenv("LD_PRELOAD", "./MyMalloc.so", 1);
+    execl("./replay", "replay", TRACE_PATH, (char *) NULL);
+    _exit(127);
+  }
+  close(fds[1]);
+  size_t n = 0;
+  ssize_t r;
+  while (n < size - 1 && (r = read(fds[0], buf + n, size - 1 - n)) > 0)
+    n += r;
+  buf[n] = '\0';
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// The number after name in the replay report, 0 if it is missing
+static size_t count(const char *report, const char *name) {
+  const char *p = strstr(report, name);
+  return p != NULL ? strtoul(p + strlen(name), NULL, 10) : 0;
+}
+
+int main(int argc, char **argv) {
+  // the trace is opened from the environment when the allocator starts
+  if (getenv("MYMALLOC_TRACE") == NULL) {
+    setenv("MYMALLOC_TRACE", TRACE_PATH, 1);
+    execv("/proc/self/exe", argv);
+    printf("exec failed\n");
+    return 1;
+  }
+
+  // printf allocates the stdout buffer, so it has to wait for the replay
+  pthread_t thread;
+  pthread_create(&thread, NULL, run, NULL);
+  pthread_join(thread, NULL);
+  run(NULL);
+  malloc_trace_flush();
+  static char report[4096];
+  int status = replay(report, sizeof(report));
+
+  printf("\n---- Running test25 ---\n");
+  printf("replay exit status: %d\n", status);
+  printf("threads: %zu\n", count(report, "threads:"));
+  printf("every call replayed: %s\n",
+         count(report, "(malloc ") >= 2 * MALLOCS && count(report, "free ") >= 2 * (MALLOCS + CALLOCS) &&
+         count(report, "realloc ") >= 2 * REALLOCS && count(report, "calloc ") >= 2 * CALLOCS ? "yes" : "no");
+  printf("frees and reallocs matched: %s\n", strstr(report, "unmatched 0)") != NULL ? "yes" : "no");
+  unlink(TRACE_PATH);
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}
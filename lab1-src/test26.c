@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "MyMalloc.h"
+
+// The heap stats. A named heap gets objects of known sizes, loses every
+// other one like test4, and is emptied: the requested bytes must follow
+// the live objects exactly, the allocated bytes must stay within a block
+// overhead of them, and the stranded blocks must show up in the free
+// block counts and the external fragmentation. The output is the same in
+// every MYMALLOC_* mode.
+
+#define OBJECTS 1000
+#define SIZE 1500
+#define SIZE_CLASS 5            // free blocks of [1024, 2048) bytes
+#define OVERHEAD 64             // most bytes a block adds to its object
+#define BIG_OBJECTS 8
+#define BIG_SIZE (1 << 20)      // objects are smaller than a 2MB chunk
+
+static int failed;
+
+#define CHECK(c) do { if (!(c)) { printf("failed: %s (line %d)\n", #c, __LINE__); failed = 1; } } while (0)
+
+// Checks what has to hold for the stats of any heap
+static void checkConsistent(MallocStats *stats) {
+  size_t blocks = 0;
+  for (int i = 0; i < MALLOC_STATS_CLASSES; i++)
+    blocks += stats->_freeBlocksPerClass[i];
+  CHECK(blocks == stats->_freeBlocks);
+  CHECK(stats->_largestFreeBlock <= stats->_freeBytes);
+  CHECK(stats->_allocatedBytes >= stats->_requestedBytes);
+  CHECK(stats->_allocatedBytes + stats->_freeBytes <= stats->_heapSize);
+}
+
+static void testNamedHeap() {
+  Heap *heap = heap_create("test26");
+  MallocStats stats;
+  heap_get_stats(heap, &stats);
+  checkConsistent(&stats);
+  CHECK(stats._requestedBytes == 0 && stats._allocatedBytes == 0);
+
+  static void *objects[OBJECTS];
+  for (int i = 0; i < OBJECTS; i++)
+    objects[i] = heap_malloc(heap, SIZE);
+  heap_get_stats(heap, &stats);
+  checkConsistent(&stats);
+  printf("requested bytes after the mallocs: %zu\n", stats._requestedBytes);
+  CHECK(stats._allocatedBytes <= (size_t) OBJECTS * (SIZE + OVERHEAD));
+  size_t freeBytes = stats._freeBytes;
+  size_t heapSize = stats._heapSize;
+
+  // every other object: the freed blocks cannot coalesce
+  for (int i = 0; i < OBJECTS; i += 2)
+    heap_free(heap, objects[i]);
+  heap_get_stats(heap, &stats);
+  checkConsistent(&stats);
+  printf("requested bytes after every other free: %zu\n", stats._requestedBytes);
+  printf("stranded blocks counted: %s\n",
+         stats._freeBlocksPerClass[SIZE_CLASS] >= OBJECTS / 2 &&
+         stats._freeBytes >= freeBytes + (size_t) OBJECTS / 2 * SIZE ? "yes" : "no");
+  printf("external fragmentation: %s\n",
+         stats._freeBytes - stats._largestFreeBlock >= (size_t) OBJECTS / 2 * SIZE ? "yes" : "no");
+  CHECK(stats._heapSize == heapSize);
+
+  for (int i = 1; i < OBJECTS; i += 2)
+    heap_free(heap, objects[i]);
+  heap_get_stats(heap, &stats);
+  checkConsistent(&stats);
+  printf("empty after the frees: %s\n",
+         stats._requestedBytes == 0 && stats._allocatedBytes == 0 ? "yes" : "no");
+  heap_destroy(heap);
+}
+
+static void testDefaultHeap() {
+  MallocStats before, after;
+  get_malloc_stats(&before);
+  checkConsistent(&before);
+
+  // slab objects count at the size of their class
+  static void *objects[OBJECTS];
+  for (int i = 0; i < OBJECTS; i++)
+    objects[i] = malloc(40);
+  char *big[BIG_OBJECTS];
+  for (int i = 0; i < BIG_OBJECTS; i++) {
+    big[i] = malloc(BIG_SIZE);
+    memset(big[i], 1, BIG_SIZE);
+  }
+  get_malloc_stats(&after);
+  checkConsistent(&after);
+  size_t requested = (size_t) OBJECTS * 40 + BIG_OBJECTS * BIG_SIZE;
+  printf("default heap: requested bytes counted: %s\n",
+         after._requestedBytes - before._requestedBytes >= requested ? "yes" : "no");
+  CHECK(after._allocatedBytes - before._allocatedBytes >= after._requestedBytes - before._requestedBytes);
+  printf("default heap: RSS counted: %s\n",
+         after._residentBytes >= before._residentBytes + BIG_OBJECTS * BIG_SIZE ? "yes" : "no");
+  for (int i = 0; i < OBJECTS; i++)
+    free(objects[i]);
+  for (int i = 0; i < BIG_OBJECTS; i++)
+    free(big[i]);
+}
+
+int main() {
+  printf("\n---- Running test26 ---\n");
+  testNamedHeap();
+  testDefaultHeap();
+  printf("checks: %s\n", failed ? "failed" : "passed");
+
+  // skip the heap listing printed at exit, which depends on the mode
+  fflush(stdout);
+  _exit(0);
+}